@@ -2,53 +2,59 @@
 #include "instance.hpp"
 #include "session.hpp"
 #include "image_tokens.hpp"
-#include <tuple>
+#include "sampler.hpp"
+#include "stream_buffer.hpp"
+#include "speculative.hpp"
+#include "stop_matcher.hpp"
+#include "grammar.hpp"
+#include "utils/laux.hpp"
+#include <algorithm>
+#include <memory>
 #include <stdexcept>
+#include <cmath>
 
 namespace {
 
 int init_arg_state(lua_State* L, int narg, const gcpp::ImageTokens* image, std::vector<cgemma::session_context>& sess_ctxs) {
   auto sess = cgemma::session::check(L, narg);
+  if (sess->busy()) {
+    throw std::invalid_argument("Sessions in a batch must not be busy.");
+  }
   if (sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
     sess->set_pos(0);
-  } else if (sess->pos() >= sess->inst()->max_tokens()) {
+  } else if (!sess->context_shift() && sess->pos() >= sess->inst()->max_tokens()) {
     throw std::invalid_argument("Sessions in a batch must not be ended.");
   }
-  if (!sess_ctxs.empty()) {
-    if (sess_ctxs.front().sess->inst() != sess->inst()) {
-      throw std::invalid_argument("Sessions in a batch must be created by the same cgemma instance.");
-    }
-    for (const auto& ctx: sess_ctxs) {
-      if (ctx.sess == sess) {
-        throw std::invalid_argument("Sessions in a batch must not be duplicated.");
-      }
-    }
+  if (!sess_ctxs.empty() && sess_ctxs.front().sess->inst() != sess->inst()) {
+    throw std::invalid_argument("Sessions in a batch must be created by the same cgemma instance.");
   }
   sess_ctxs.emplace_back(sess);
+  sess_ctxs.back().image = image;
   return 1;
 }
 
-std::tuple<const gcpp::ImageTokens*, std::vector<cgemma::session_context>> parse_args(lua_State* L) {
+void read_prompt(lua_State* L, int narg, cgemma::session_context& ctx) {
+  ctx.prompt = ctx.sess->read_prompt(L, narg, ctx.image);
+  if (ctx.image && ctx.sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+    ctx.prefix_end = ctx.prompt.size();
+  }
+}
+
+std::vector<cgemma::session_context> parse_args(lua_State* L) {
   constexpr decltype(init_arg_state)* const arg_states[] = {
     init_arg_state,
     [](lua_State* L, int narg, const gcpp::ImageTokens* image, std::vector<cgemma::session_context>& sess_ctxs) {
-      size_t len;
-      auto text = luaL_checklstring(L, narg, &len);
       auto& ctx = sess_ctxs.back();
-      if (image) {
-        ctx.prompt = ctx.sess->tokenize(*image, text, len);
-        if (ctx.sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
-          ctx.prefix_end = ctx.prompt.size();
-        }
-      } else {
-        ctx.prompt = ctx.sess->tokenize(text, len);
+      if (auto img = cgemma::image_tokens::to(L, narg)) {
+        ctx.image = img;
+        return 1;
       }
+      read_prompt(L, narg, ctx);
       return 2;
     },
     [](lua_State* L, int narg, const gcpp::ImageTokens* image, std::vector<cgemma::session_context>& sess_ctxs) {
       auto& ctx = sess_ctxs.back();
       if (lua_isfunction(L, narg)) {
-        ctx.output.resize(1);
         ctx.stream_fn = narg;
         return 0;
       } else {
@@ -72,44 +78,201 @@ std::tuple<const gcpp::ImageTokens*, std::vector<cgemma::session_context>> parse
   if (sess_ctxs.back().prompt.empty()) {
     luaL_error(L, "Too few arguments, %d expected", nargs + 1);
   }
-  return {image, std::move(sess_ctxs)};
+  // Scoring runs in forks and allows a session more than once, generating
+  // does not.
+  for (size_t i = 1; i < sess_ctxs.size(); ++i) {
+    for (size_t j = 0; j < i; ++j) {
+      if (sess_ctxs[i].sess == sess_ctxs[j].sess) {
+        throw std::invalid_argument("Sessions in a batch must not be duplicated.");
+      }
+    }
+  }
+  return sess_ctxs;
 }
 
-gcpp::RuntimeConfig parse_config(const std::vector<cgemma::session_context>& sess_ctxs) {
+// Parses arguments of the form `sess, [img, ]prompt, continuation, ...`, the
+// continuations are tokenized as is.
+std::vector<cgemma::session_context> parse_score_args(lua_State* L, std::vector<std::vector<int>>& continuations) {
+  auto nargs = lua_gettop(L);
+  if (nargs < 3) {
+    luaL_error(L, "Too few arguments, at least %d expected", 3);
+  }
+  std::vector<cgemma::session_context> sess_ctxs;
+  sess_ctxs.reserve(nargs / 3);
+  for (auto i = 1; i <= nargs;) {
+    i += init_arg_state(L, i, nullptr, sess_ctxs);
+    auto& ctx = sess_ctxs.back();
+    if (auto img = cgemma::image_tokens::to(L, i)) {
+      ctx.image = img;
+      ++i;
+    }
+    read_prompt(L, i++, ctx);
+    size_t len;
+    auto text = luaL_checklstring(L, i++, &len);
+    continuations.push_back(ctx.sess->inst()->encode(text, len));
+    if (continuations.back().empty()) {
+      throw std::invalid_argument("Continuations must not be empty.");
+    }
+  }
+  return sess_ctxs;
+}
+
+gcpp::RuntimeConfig parse_config(std::vector<cgemma::session_context>& sess_ctxs, const std::vector<size_t>& group) {
   gcpp::RuntimeConfig cfg;
-  cfg.max_generated_tokens = 8192 - 1;
+  cfg.max_generated_tokens = 0;
   cfg.prefill_tbatch_size = 4096;
   cfg.decode_qbatch_size = 4096;
   cfg.temperature = 0.0f;
   cfg.top_k = 1;
   for (const auto& ctx: sess_ctxs) {
-    cfg.max_generated_tokens = std::min(cfg.max_generated_tokens, ctx.sess->args().max_generated_tokens);
+    cfg.max_generated_tokens = std::max(cfg.max_generated_tokens, ctx.sess->args().max_generated_tokens);
     cfg.prefill_tbatch_size = std::min(cfg.prefill_tbatch_size, ctx.sess->args().prefill_tbatch_size);
     cfg.decode_qbatch_size = std::min(cfg.decode_qbatch_size, ctx.sess->args().decode_qbatch_size);
-    cfg.temperature += ctx.sess->args().temperature;
     cfg.top_k = std::max(cfg.top_k, ctx.sess->args().top_k);
   }
-  cfg.temperature /= sess_ctxs.size();
+  auto constrained = std::any_of(sess_ctxs.begin(), sess_ctxs.end(), [](const cgemma::session_context& ctx) {
+    return ctx.sess->constraint() || !ctx.sess->filter().empty();
+  });
+  // Greedy batches without grammars or filters keep the built-in sampler,
+  // otherwise each query samples with the arguments, the random generator,
+  // the filter and the grammar of its own session.
+  if (cfg.top_k > 1 || constrained) {
+    cfg.sample_func = [&sess_ctxs, &group](size_t query_idx, size_t, gcpp::Logits logits, size_t) {
+      auto& ctx = sess_ctxs[group[query_idx]];
+      auto sess = ctx.sess;
+      auto g = sess->constraint().get();
+      if (g) {
+        g->mask(ctx.grammar_state, logits);
+      }
+      auto tp = cgemma::sample(logits, sess->args().temperature, sess->args().top_k, sess->filter(), sess->rng());
+      if (g) {
+        ctx.grammar_state = g->advance(ctx.grammar_state, tp.token);
+      }
+      return tp;
+    };
+  }
   return cfg;
 }
 
-gcpp::TimingInfo generate(cgemma::instance* inst, const std::vector<cgemma::session_context>& sess_ctxs, const gcpp::RuntimeConfig& cfg) {
+// `GenerateBatch` takes a single set of image tokens, so queries are run in
+// groups sharing the same image. Text-only queries do not reference the image
+// tokens and join the first group, except for PaliGemma which prefixes every
+// prompt with them.
+std::vector<std::vector<size_t>> group_by_image(const std::vector<cgemma::session_context>& sess_ctxs) {
+  auto paligemma = sess_ctxs.front().sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA;
+  std::vector<const gcpp::ImageTokens*> images;
+  std::vector<std::vector<size_t>> groups;
+  for (size_t i = 0; i < sess_ctxs.size(); ++i) {
+    auto image = sess_ctxs[i].image;
+    if (!image && !paligemma) {
+      continue;
+    }
+    auto it = std::find(images.begin(), images.end(), image);
+    if (it == images.end()) {
+      images.push_back(image);
+      groups.emplace_back();
+      it = images.end() - 1;
+    }
+    groups[it - images.begin()].push_back(i);
+  }
+  if (!paligemma) {
+    for (size_t i = 0; i < sess_ctxs.size(); ++i) {
+      if (!sess_ctxs[i].image) {
+        if (groups.empty()) {
+          groups.emplace_back();
+        }
+        groups.front().push_back(i);
+      }
+    }
+  }
+  return groups;
+}
+
+gcpp::TimingInfo generate_group(cgemma::instance* inst, const std::vector<cgemma::session_context>& sess_ctxs, const std::vector<size_t>& group, const gcpp::RuntimeConfig& cfg) {
   gcpp::TimingInfo timing;
   gcpp::AllQueries queries;
-  queries.Reserve(sess_ctxs.size());
-  for (const auto& ctx: sess_ctxs) {
+  queries.Reserve(group.size());
+  for (auto i: group) {
+    const auto& ctx = sess_ctxs[i];
+    auto cached = ctx.image ? 0 : ctx.sess->restore_prefix(ctx.prompt);
     queries.Append(gcpp::PerQuery{
-      .prompt = gcpp::PromptTokens(ctx.prompt.data(), ctx.prompt.size()),
-      .mutable_pos = ctx.start_pos,
-      .initial_pos = ctx.start_pos,
+      .prompt = gcpp::PromptTokens(ctx.prompt.data() + cached, ctx.prompt.size() - cached),
+      .mutable_pos = ctx.start_pos + cached,
+      .initial_pos = ctx.start_pos + cached,
       .prefix_end = ctx.prefix_end,
-      .kv_cache = ctx.sess->kv_cache()
+      .kv_cache = ctx.sess->mutable_kv_cache()
     });
   }
+  if (inst->kv_offload()) {
+    inst->kv_offload()->trim(group.size());
+  }
+  cgemma::scheduler::generation_lock lock(inst->sched());
   inst->model().GenerateBatch(cfg, queries, inst->matmul_env(), timing);
+  for (auto i: group) {
+    const auto& ctx = sess_ctxs[i];
+    if (!ctx.image && ctx.start_pos == 0) {
+      ctx.sess->cache_prefix(ctx.prompt);
+    }
+  }
+  return timing;
+}
+
+// Runs the groups one after another, `group` holds the indices of the
+// queries in the running one.
+gcpp::TimingInfo generate(cgemma::instance* inst, const std::vector<cgemma::session_context>& sess_ctxs, std::vector<size_t>& group, gcpp::RuntimeConfig& cfg) {
+  gcpp::TimingInfo timing {};
+  auto prefill_tbatch_size = cfg.prefill_tbatch_size;
+  for (auto& g: group_by_image(sess_ctxs)) {
+    group = std::move(g);
+    cfg.image_tokens = nullptr;
+    cfg.prefill_tbatch_size = prefill_tbatch_size;
+    for (auto i: group) {
+      if (sess_ctxs[i].image) {
+        cfg.image_tokens = sess_ctxs[i].image;
+        cfg.prefill_tbatch_size = std::max(cfg.prefill_tbatch_size, sess_ctxs[i].prefix_end);
+      }
+    }
+    auto t = generate_group(inst, sess_ctxs, group, cfg);
+    if (timing.prefill_tokens == 0) {
+      timing.time_to_first_token = t.time_to_first_token;
+    }
+    timing.prefill_duration += t.prefill_duration;
+    timing.prefill_tokens += t.prefill_tokens;
+    timing.generate_duration += t.generate_duration;
+    timing.tokens_generated += t.tokens_generated;
+  }
   return timing;
 }
 
+// Records a token of a query without a stream function, returns whether the
+// query goes on.
+bool collect(cgemma::session_context& ctx, cgemma::stop_matcher& stop, size_t pos, int token) {
+  if (pos - ctx.start_pos >= ctx.prompt.size()) {
+    if (ctx.sess->inst()->eos(token)) {
+      return false;
+    }
+    ctx.output.push_back(token);
+    ctx.sess->set_pos(pos);
+    return ++ctx.generated < ctx.sess->args().max_generated_tokens && !stop.push(token);
+  }
+  ctx.sess->set_pos(pos);
+  return true;
+}
+
+// Feeds the prompt and the reply of a query to the speculator of its session,
+// so that the draft can catch up with the batch.
+void follow_spec(const cgemma::session_context& ctx) {
+  auto spec = ctx.sess->spec();
+  if (!spec) {
+    return;
+  }
+  if (ctx.image) {
+    spec->invalidate();
+  } else {
+    spec->append(ctx.sess, ctx.start_pos, ctx.prompt, ctx.output);
+  }
+}
+
 constexpr const char name[] = "cgemma.batch_result";
 
 int call(lua_State* L) {
@@ -124,13 +287,7 @@ int call(lua_State* L) {
   if (ctx->stream_fn > 0) {
     lua_pushboolean(L, 1);
   } else {
-    std::string resp;
-    if (!sess->inst()->model().Tokenizer().Decode(ctx->output, &resp)) {
-      lua_pushnil(L);
-      lua_pushliteral(L, "Tokenizer decoding failed.");
-      return 2;
-    }
-    lua_pushlstring(L, resp.data(), resp.size());
+    cgemma::push_output(L, sess, ctx->output);
   }
   return 1;
 }
@@ -151,68 +308,166 @@ namespace cgemma {
 
 int batch(lua_State* L) {
   try {
-    const gcpp::ImageTokens* image;
-    std::vector<cgemma::session_context> sess_ctxs;
-    std::tie(image, sess_ctxs) = parse_args(L);
-    auto cfg = parse_config(sess_ctxs);
+    auto sess_ctxs = parse_args(L);
+    std::vector<size_t> group;
+    auto cfg = parse_config(sess_ctxs, group);
     cfg.verbosity = 0;
+    if (sess_ctxs.front().sess->inst()->model().Config().wrapping != gcpp::PromptWrapping::PALIGEMMA) {
+      for (auto& ctx: sess_ctxs) {
+        ctx.sess->make_room(ctx.prompt.size() + ctx.sess->args().max_generated_tokens);
+        ctx.start_pos = ctx.sess->pos();
+      }
+    }
     auto inst = sess_ctxs.front().sess->inst();
+    std::vector<cgemma::stream_buffer> bufs;
+    std::vector<size_t> last_pos;
+    std::vector<cgemma::stop_matcher> stops;
+    // Set once a stream has ended or its stream function stopped it, nothing
+    // is delivered to that stream function after that.
+    std::vector<bool> done(sess_ctxs.size(), false);
+    bufs.reserve(sess_ctxs.size());
+    last_pos.reserve(sess_ctxs.size());
+    stops.reserve(sess_ctxs.size());
+    for (const auto& ctx: sess_ctxs) {
+      bufs.emplace_back(inst, ctx.sess->stream_opts());
+      last_pos.push_back(ctx.start_pos);
+      stops.emplace_back(inst, ctx.sess->stop_opts());
+    }
+    // The first error of a stream function stops the batch, it is raised once
+    // the generation is left.
+    std::string err;
+    auto call_stream_fn = [&](size_t i, const std::string* text, size_t pos) {
+      if (!err.empty()) {
+        return false;
+      }
+      const auto& ctx = sess_ctxs[i];
+      lua_pushvalue(L, ctx.stream_fn);
+      if (text) {
+        lua_pushlstring(L, text->data(), text->size());
+      } else {
+        lua_pushnil(L);
+      }
+      lua_pushinteger(L, pos - ctx.start_pos);
+      lua_pushinteger(L, ctx.prompt.size());
+      if (!utils::pcall(L, 3, 1, err)) {
+        return false;
+      }
+      auto res = lua_toboolean(L, -1) ? true : false;
+      lua_pop(L, 1);
+      return res;
+    };
     cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int token, float) {
-      auto& ctx = sess_ctxs[query_idx];
+      auto i = group[query_idx];
+      auto& ctx = sess_ctxs[i];
+      if (!err.empty()) {
+        return false;
+      }
       if (ctx.stream_fn == 0) {
-        if (pos - ctx.start_pos >= ctx.prompt.size()) {
-          if (inst->eos(token)) {
-            return false;
-          }
-          ctx.output.push_back(token);
-        }
-        ctx.sess->set_pos(pos);
-        return true;
+        return collect(ctx, stops[i], pos, token);
       } else {
-        auto eot = false;
-        lua_pushvalue(L, ctx.stream_fn);
+        auto& buf = bufs[i];
         if (pos - ctx.start_pos < ctx.prompt.size()) {
-          lua_pushnil(L);
-        } else if (inst->eos(token)) {
-          eot = true;
-          lua_pushnil(L);
-        } else {
-          ctx.output.front() = token;
-          std::string token_text;
-          if (!inst->model().Tokenizer().Decode(ctx.output, &token_text)) {
-            throw std::runtime_error("Tokenizer decoding failed. (batch stream_mode)");
+          if (buf.prefill() && !call_stream_fn(i, nullptr, pos)) {
+            done[i] = true;
+            return false;
           }
-          lua_pushlstring(L, token_text.data(), token_text.size());
-        }
-        lua_pushinteger(L, pos - ctx.start_pos);
-        lua_pushinteger(L, ctx.prompt.size());
-        lua_call(L, 3, 1);
-        auto res = lua_toboolean(L, -1);
-        lua_pop(L, 1);
-        if (!eot && res) {
           ctx.sess->set_pos(pos);
           return true;
-        } else {
+        }
+        if (inst->eos(token)) {
+          buf.finish();
+          if (!buf.text().empty()) {
+            call_stream_fn(i, &buf.text(), last_pos[i]);
+          }
+          buf.flush();
+          call_stream_fn(i, nullptr, pos);
+          done[i] = true;
           return false;
         }
+        auto stopped = stops[i].push(token);
+        if (buf.push(token) || stopped) {
+          if (stopped) {
+            buf.finish();
+          }
+          auto more = buf.text().empty() || call_stream_fn(i, &buf.text(), pos);
+          buf.flush();
+          if (!more) {
+            done[i] = true;
+            return false;
+          }
+        }
+        last_pos[i] = pos;
+        ctx.output.push_back(token);
+        ctx.sess->set_pos(pos);
+        if (stopped) {
+          call_stream_fn(i, nullptr, pos);
+          done[i] = true;
+          return false;
+        }
+        return ++ctx.generated < ctx.sess->args().max_generated_tokens;
       }
     };
-    if (!inst->disabled_tokens().empty()) {
-      cfg.accept_token = [&](int token, float) {
-        return inst->disabled_tokens().find(token) == inst->disabled_tokens().end();
-      };
+    auto timing = generate(inst, sess_ctxs, group, cfg);
+    for (const auto& ctx: sess_ctxs) {
+      follow_spec(ctx);
     }
-    if (image) {
-      if (inst->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
-        size_t prefix_end = 0;
-        for (const auto& ctx: sess_ctxs) {
-          prefix_end = std::max(prefix_end, ctx.prefix_end);
-        }
-        cfg.prefill_tbatch_size = std::max(cfg.prefill_tbatch_size, prefix_end);
+    for (size_t i = 0; i < sess_ctxs.size(); ++i) {
+      if (sess_ctxs[i].stream_fn == 0 || done[i]) {
+        continue;
       }
-      cfg.image_tokens = image;
+      bufs[i].finish();
+      if (!bufs[i].text().empty()) {
+        call_stream_fn(i, &bufs[i].text(), last_pos[i]);
+      }
+    }
+    if (!err.empty()) {
+      throw std::runtime_error(err);
+    }
+    batch_result result(std::move(sess_ctxs), std::move(timing));
+    auto ud = lua_newuserdata(L, sizeof(batch_result));
+    new(ud) batch_result(std::move(result));
+    luaL_getmetatable(L, name);
+    lua_setmetatable(L, -2);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int prefill(lua_State* L) {
+  try {
+    auto sess_ctxs = parse_args(L);
+    for (const auto& ctx: sess_ctxs) {
+      if (ctx.stream_fn != 0) {
+        throw std::invalid_argument("Stream functions are not allowed in a prefill call.");
+      }
+    }
+    std::vector<size_t> group;
+    auto cfg = parse_config(sess_ctxs, group);
+    cfg.verbosity = 0;
+    cfg.max_generated_tokens = 0;
+    cfg.sample_func = nullptr;
+    if (sess_ctxs.front().sess->inst()->model().Config().wrapping != gcpp::PromptWrapping::PALIGEMMA) {
+      for (auto& ctx: sess_ctxs) {
+        ctx.sess->make_room(ctx.prompt.size());
+        ctx.start_pos = ctx.sess->pos();
+      }
+    }
+    auto inst = sess_ctxs.front().sess->inst();
+    cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int, float) {
+      auto& ctx = sess_ctxs[group[query_idx]];
+      if (pos - ctx.start_pos >= ctx.prompt.size()) {
+        return false;
+      }
+      ctx.sess->set_pos(pos);
+      return true;
+    };
+    auto timing = generate(inst, sess_ctxs, group, cfg);
+    for (const auto& ctx: sess_ctxs) {
+      follow_spec(ctx);
     }
-    auto timing = generate(inst, sess_ctxs, cfg);
     batch_result result(std::move(sess_ctxs), std::move(timing));
     auto ud = lua_newuserdata(L, sizeof(batch_result));
     new(ud) batch_result(std::move(result));
@@ -228,7 +483,8 @@ int batch(lua_State* L) {
 
 session_context::session_context(session* s)
   : sess(s)
-  , start_pos(s->pos()) {
+  , start_pos(s->pos())
+  , grammar_state(s->constraint() ? s->constraint()->initial() : 0) {
   // nop
 }
 
@@ -271,4 +527,173 @@ batch_result* batch_result::check(lua_State* L, int index) {
   return static_cast<batch_result*>(luaL_checkudata(L, index, name));
 }
 
+int score(lua_State* L) {
+  try {
+    std::vector<std::vector<int>> continuations;
+    auto sess_ctxs = parse_score_args(L, continuations);
+    // Scoring runs in forks, so the sessions are left as they are. Forking
+    // draws a seed from the random generator, which is put back as well.
+    std::vector<std::unique_ptr<session>> forks;
+    forks.reserve(sess_ctxs.size());
+    for (auto& ctx: sess_ctxs) {
+      auto rng = ctx.sess->rng();
+      ctx.sess->fault_in();
+      forks.push_back(std::make_unique<session>(ctx.sess));
+      ctx.sess->rng() = rng;
+      forks.back()->set_spec(nullptr);
+      ctx.sess = forks.back().get();
+    }
+    std::vector<size_t> group;
+    auto cfg = parse_config(sess_ctxs, group);
+    cfg.verbosity = 0;
+    cfg.max_generated_tokens = 0;
+    for (const auto& c: continuations) {
+      cfg.max_generated_tokens = std::max(cfg.max_generated_tokens, c.size());
+    }
+    if (sess_ctxs.front().sess->inst()->model().Config().wrapping != gcpp::PromptWrapping::PALIGEMMA) {
+      for (size_t i = 0; i < sess_ctxs.size(); ++i) {
+        auto& ctx = sess_ctxs[i];
+        ctx.sess->make_room(ctx.prompt.size() + continuations[i].size());
+        ctx.start_pos = ctx.sess->pos();
+      }
+    }
+    // The continuations are forced in place of sampling, so each decode step
+    // scores a token of every query at once.
+    std::vector<std::vector<float>> log_probs(sess_ctxs.size());
+    cfg.sample_func = [&](size_t query_idx, size_t, gcpp::Logits logits, size_t) {
+      auto i = group[query_idx];
+      const auto& c = continuations[i];
+      auto k = log_probs[i].size();
+      auto token = c[std::min(k, c.size() - 1)];
+      auto lp = log_prob(logits, token);
+      if (k < c.size()) {
+        log_probs[i].push_back(lp);
+      }
+      return gcpp::TokenAndProb{token, std::exp(lp)};
+    };
+    cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int, float) {
+      auto i = group[query_idx];
+      auto& ctx = sess_ctxs[i];
+      if (pos - ctx.start_pos >= ctx.prompt.size()) {
+        ctx.sess->set_pos(pos);
+        return ++ctx.generated < continuations[i].size();
+      }
+      ctx.sess->set_pos(pos);
+      return true;
+    };
+    auto inst = sess_ctxs.front().sess->inst();
+    generate(inst, sess_ctxs, group, cfg);
+    lua_createtable(L, sess_ctxs.size(), 0);
+    for (size_t i = 0; i < sess_ctxs.size(); ++i) {
+      lua_createtable(L, 0, 2);
+      lua_createtable(L, log_probs[i].size(), 0);
+      auto sum = 0.0;
+      for (size_t k = 0; k < log_probs[i].size(); ++k) {
+        sum += log_probs[i][k];
+        lua_pushnumber(L, log_probs[i][k]);
+        lua_rawseti(L, -2, k + 1);
+      }
+      lua_setfield(L, -2, "log_probs");
+      lua_pushnumber(L, sum);
+      lua_setfield(L, -2, "sum");
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int samples(lua_State* L) {
+  auto sess = session::check(L, 1);
+  auto n = luaL_checkinteger(L, 2);
+  if (n <= 0) {
+    luaL_argerror(L, 2, "n must be positive");
+  }
+  auto image = image_tokens::to(L, 3);
+  try {
+    auto inst = sess->inst();
+    if (sess->busy()) {
+      throw std::invalid_argument("Session is busy.");
+    }
+    if (inst->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+      throw std::invalid_argument("Samples are not supported by PaliGemma models.");
+    }
+    if (!sess->context_shift() && sess->pos() >= inst->max_tokens()) {
+      throw std::invalid_argument("Session has ended.");
+    }
+    auto prompt = sess->read_prompt(L, image ? 4 : 3, image);
+    if (prompt.empty()) {
+      throw std::invalid_argument("Prompt must not be empty.");
+    }
+    sess->make_room(prompt.size() + sess->args().max_generated_tokens);
+
+    // The session prefills the prompt once, then each sample feeds the last
+    // token again at its position in a fork of its own, as a query of the
+    // engine carries over to the next step.
+    std::vector<size_t> group;
+    std::vector<session_context> head;
+    head.emplace_back(sess);
+    head.front().prompt = prompt;
+    head.front().image = image;
+    auto head_cfg = parse_config(head, group);
+    head_cfg.verbosity = 0;
+    head_cfg.max_generated_tokens = 0;
+    head_cfg.sample_func = nullptr;
+    head_cfg.batch_stream_token = [&](size_t, size_t pos, int, float) {
+      const auto& ctx = head.front();
+      if (pos - ctx.start_pos >= ctx.prompt.size()) {
+        return false;
+      }
+      sess->set_pos(pos);
+      return true;
+    };
+    auto timing = generate(inst, head, group, head_cfg);
+    follow_spec(head.front());
+
+    // Forks share the prefilled rows until they write to their KV caches,
+    // which copies the rows instead of computing them again.
+    lua_createtable(L, n, 0);
+    std::vector<session_context> sess_ctxs;
+    sess_ctxs.reserve(n);
+    for (lua_Integer i = 0; i < n; ++i) {
+      auto fork = session::push_fork(L, sess);
+      lua_rawseti(L, -2, i + 1);
+      fork->set_spec(nullptr);
+      sess_ctxs.emplace_back(fork);
+      sess_ctxs.back().prompt.assign(1, prompt.back());
+      sess_ctxs.back().output.reserve(fork->args().max_generated_tokens);
+    }
+    auto cfg = parse_config(sess_ctxs, group);
+    cfg.verbosity = 0;
+    std::vector<stop_matcher> stops;
+    stops.reserve(sess_ctxs.size());
+    for (const auto& ctx: sess_ctxs) {
+      stops.emplace_back(inst, ctx.sess->stop_opts());
+    }
+    cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int token, float) {
+      auto i = group[query_idx];
+      return collect(sess_ctxs[i], stops[i], pos, token);
+    };
+    auto t = generate(inst, sess_ctxs, group, cfg);
+    timing.time_to_first_token = timing.prefill_duration + t.time_to_first_token;
+    timing.prefill_duration += t.prefill_duration;
+    timing.prefill_tokens += t.prefill_tokens;
+    timing.generate_duration = t.generate_duration;
+    timing.tokens_generated = t.tokens_generated;
+    batch_result result(std::move(sess_ctxs), std::move(timing));
+    auto ud = lua_newuserdata(L, sizeof(batch_result));
+    new(ud) batch_result(std::move(result));
+    luaL_getmetatable(L, name);
+    lua_setmetatable(L, -2);
+    return 2;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
 }
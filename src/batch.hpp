@@ -10,6 +10,9 @@
 namespace cgemma {
 
 int batch(lua_State* L);
+int prefill(lua_State* L);
+int samples(lua_State* L);
+int score(lua_State* L);
 
 class session;
 
@@ -20,8 +23,12 @@ struct session_context {
   std::vector<int> prompt;
   size_t start_pos;
   size_t prefix_end = 0;
+  const gcpp::ImageTokens* image = nullptr;
   std::vector<int> output;
+  size_t generated = 0;
   int stream_fn = 0;
+  // State of the grammar of the session, if any.
+  int grammar_state = 0;
 };
 
 class batch_result {
@@ -3,6 +3,9 @@
 #include "session.hpp"
 #include "image_tokens.hpp"
 #include "batch.hpp"
+#include "engine.hpp"
+#include "task.hpp"
+#include "grammar.hpp"
 #include <hwy/timer.h>
 #include <hwy/per_target.h>
 #include <hwy/targets.h>
@@ -43,6 +46,10 @@ int luaopen_cgemma(lua_State* L) {
     {"scheduler", cgemma::scheduler::create},
     {"new", cgemma::instance::create},
     {"batch", cgemma::batch},
+    {"prefill", cgemma::prefill},
+    {"samples", cgemma::samples},
+    {"score", cgemma::score},
+    {"engine", cgemma::engine::create},
     {nullptr, nullptr}
   };
   cgemma::scheduler::declare(L);
@@ -50,6 +57,9 @@ int luaopen_cgemma(lua_State* L) {
   cgemma::session::declare(L);
   cgemma::image_tokens::declare(L);
   cgemma::batch_result::declare(L);
+  cgemma::engine::declare(L);
+  cgemma::task::declare(L);
+  cgemma::grammar::declare(L);
   lua_newtable(L);
   luaL_register(L, nullptr, entries);
   lua_pushliteral(L, "cgemma");
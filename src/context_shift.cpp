@@ -0,0 +1,123 @@
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "context_shift.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+#include "context_shift.hpp"
+#include "utils/convert.hpp"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+HWY_BEFORE_NAMESPACE();
+namespace cgemma { namespace HWY_NAMESPACE {
+
+namespace hn = hwy::HWY_NAMESPACE;
+
+// Rotates the pairs (x[i], y[i]) by the angles of the given cosines and sines.
+void RotatePairs(float* HWY_RESTRICT x, float* HWY_RESTRICT y, size_t n, const float* HWY_RESTRICT cos, const float* HWY_RESTRICT sin) {
+  const hn::ScalableTag<float> df;
+  const size_t N = hn::Lanes(df);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    const auto vx = hn::LoadU(df, x + i);
+    const auto vy = hn::LoadU(df, y + i);
+    const auto vc = hn::LoadU(df, cos + i);
+    const auto vs = hn::LoadU(df, sin + i);
+    hn::StoreU(hn::MulSub(vx, vc, hn::Mul(vy, vs)), df, x + i);
+    hn::StoreU(hn::MulAdd(vx, vs, hn::Mul(vy, vc)), df, y + i);
+  }
+  for (; i < n; ++i) {
+    const auto x0 = x[i];
+    const auto y0 = y[i];
+    x[i] = x0 * cos[i] - y0 * sin[i];
+    y[i] = x0 * sin[i] + y0 * cos[i];
+  }
+}
+
+} }
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace {
+
+// Cosines and sines rotating the keys of a layer by a fixed position delta,
+// they are the same for every row.
+struct rotation {
+  size_t half_dim;
+  std::vector<float> cos;
+  std::vector<float> sin;
+};
+
+rotation make_rotation(const gcpp::ModelConfig& config, size_t layer, double delta) {
+  const auto& layer_config = config.layer_configs[layer];
+  auto rope_dim = layer_config.post_qk == gcpp::PostQKType::HalfRope ? layer_config.qkv_dim / 2 : layer_config.qkv_dim;
+  // Same bases as gemma.cpp: global layers of Gemma 3 use a longer one.
+  auto base = gcpp::IsVLM(config.model) && config.IsGlobalLayer(layer) ? 1000000.0 : 10000.0;
+  rotation r;
+  r.half_dim = rope_dim / 2;
+  r.cos.resize(r.half_dim);
+  r.sin.resize(r.half_dim);
+  for (size_t i = 0; i < r.half_dim; ++i) {
+    auto theta = delta / std::pow(base, static_cast<double>(2 * i) / rope_dim);
+    r.cos[i] = static_cast<float>(std::cos(theta));
+    r.sin[i] = static_cast<float>(std::sin(theta));
+  }
+  return r;
+}
+
+}
+
+namespace cgemma {
+
+HWY_EXPORT(RotatePairs);
+
+void shift_context(gcpp::KVCache& kv_cache, const gcpp::ModelConfig& config, size_t pos, size_t sink, size_t discard) {
+  auto& mat = kv_cache.kv_cache;
+  if (discard == 0 || sink + discard > pos || pos > mat.Rows()) {
+    throw std::invalid_argument("Invalid context shift");
+  }
+  auto row_bytes = mat.Stride() * mat.ElementBytes();
+  auto moved = pos - sink - discard;
+  if (row_bytes == 0 || moved == 0) {
+    return;
+  }
+  if (mat.ElementBytes() != sizeof(float) && mat.ElementBytes() != sizeof(hwy::bfloat16_t)) {
+    throw std::invalid_argument("Unsupported KVCache element type");
+  }
+  std::memmove(mat.RowBytes(sink), mat.RowBytes(sink + discard), moved * row_bytes);
+  std::vector<rotation> rotations;
+  rotations.reserve(config.layer_configs.size());
+  for (size_t i = 0; i < config.layer_configs.size(); ++i) {
+    rotations.push_back(make_rotation(config, i, -static_cast<double>(discard)));
+  }
+  std::vector<float> tmp;
+  for (auto row = sink; row < sink + moved; ++row) {
+    auto p = mat.RowBytes(row);
+    size_t layer_offset = 0;
+    for (size_t i = 0; i < config.layer_configs.size(); ++i) {
+      const auto& layer_config = config.layer_configs[i];
+      const auto& r = rotations[i];
+      for (size_t j = 0; j < layer_config.kv_heads; ++j) {
+        // Keys and values of each head are interleaved, only keys are rotated.
+        auto k = p + (layer_offset + j * layer_config.qkv_dim * 2) * mat.ElementBytes();
+        if (mat.ElementBytes() == sizeof(float)) {
+          auto x = reinterpret_cast<float*>(k);
+          HWY_DYNAMIC_DISPATCH(RotatePairs)(x, x + r.half_dim, r.half_dim, r.cos.data(), r.sin.data());
+        } else {
+          auto x = reinterpret_cast<hwy::bfloat16_t*>(k);
+          tmp.resize(r.half_dim * 2);
+          utils::bf16_to_f32(x, tmp.size(), tmp.data());
+          HWY_DYNAMIC_DISPATCH(RotatePairs)(tmp.data(), tmp.data() + r.half_dim, r.half_dim, r.cos.data(), r.sin.data());
+          utils::f32_to_bf16(tmp.data(), tmp.size(), x);
+        }
+      }
+      layer_offset += layer_config.CacheLayerSize();
+    }
+  }
+}
+
+}
+
+#endif  // HWY_ONCE
@@ -0,0 +1,16 @@
+#ifndef CGEMMA_CONTEXT_SHIFT_HPP
+#define CGEMMA_CONTEXT_SHIFT_HPP
+
+#include <gemma/gemma.h>
+#include <cstddef>
+
+namespace cgemma {
+
+// Drops `discard` rows of `kv_cache` right after the first `sink` ones and
+// moves the rows behind them (up to `pos`) forward, their keys are rotated
+// back to their new positions.
+void shift_context(gcpp::KVCache& kv_cache, const gcpp::ModelConfig& config, size_t pos, size_t sink, size_t discard);
+
+}
+
+#endif  // CGEMMA_CONTEXT_SHIFT_HPP
@@ -0,0 +1,115 @@
+#include "detokenizer.hpp"
+#include <src/sentencepiece_processor.h>
+#include <stdexcept>
+#include <cstdlib>
+
+namespace {
+
+constexpr const char space_symbol[] = "\xE2\x96\x81";
+constexpr const char replacement_char[] = "\xEF\xBF\xBD";
+
+size_t sequence_size(unsigned char lead) {
+  if ((lead & 0xE0) == 0xC0) {
+    return 2;
+  } else if ((lead & 0xF0) == 0xE0) {
+    return 3;
+  } else if ((lead & 0xF8) == 0xF0) {
+    return 4;
+  } else {
+    return 0;
+  }
+}
+
+}
+
+namespace cgemma {
+
+piece_table::piece_table(const gcpp::GemmaTokenizer& tokenizer) {
+  sentencepiece::SentencePieceProcessor sp;
+  if (!sp.LoadFromSerializedProto(tokenizer.Serialize()).ok()) {
+    throw std::runtime_error("Failed to load the tokenizer model. (piece_table)");
+  }
+  auto n = sp.GetPieceSize();
+  offsets_.reserve(n + 1);
+  offsets_.push_back(0);
+  int spaced_token = -1;
+  for (int id = 0; id < n; ++id) {
+    if (sp.IsByte(id)) {
+      // Byte-fallback pieces look like <0x41>.
+      bytes_.push_back(static_cast<char>(std::strtol(sp.IdToPiece(id).c_str() + 3, nullptr, 16)));
+    } else if (sp.IsUnknown(id)) {
+      bytes_ += " \xE2\x81\x87 ";
+    } else if (!sp.IsControl(id)) {
+      const auto& piece = sp.IdToPiece(id);
+      if (spaced_token < 0 && piece.compare(0, sizeof(space_symbol) - 1, space_symbol) == 0) {
+        spaced_token = id;
+      }
+      for (size_t i = 0; i < piece.size();) {
+        if (piece.compare(i, sizeof(space_symbol) - 1, space_symbol) == 0) {
+          bytes_.push_back(' ');
+          i += sizeof(space_symbol) - 1;
+        } else {
+          bytes_.push_back(piece[i++]);
+        }
+      }
+    }
+    offsets_.push_back(bytes_.size());
+  }
+  if (spaced_token >= 0) {
+    std::string text;
+    if (tokenizer.Decode(std::vector<int>{spaced_token}, &text)) {
+      strip_leading_space_ = text.size() < piece(spaced_token).size();
+    }
+  }
+}
+
+void detokenizer::append(int token, std::string& out) {
+  auto piece = table_->piece(token);
+  if (at_start_) {
+    if (table_->strip_leading_space() && !piece.empty() && piece.front() == ' ') {
+      piece.remove_prefix(1);
+    }
+    at_start_ = piece.empty();
+  }
+  for (auto c: piece) {
+    auto b = static_cast<unsigned char>(c);
+    if (pending_size_ > 0) {
+      if ((b & 0xC0) == 0x80) {
+        pending_[pending_size_++] = c;
+        if (pending_size_ == expected_size_) {
+          out.append(pending_, pending_size_);
+          pending_size_ = 0;
+        }
+        continue;
+      }
+      out += replacement_char;
+      pending_size_ = 0;
+    }
+    if (b < 0x80) {
+      out.push_back(c);
+    } else if ((expected_size_ = sequence_size(b)) > 0) {
+      pending_[pending_size_++] = c;
+    } else {
+      out += replacement_char;
+    }
+  }
+}
+
+void detokenizer::finish(std::string& out) {
+  if (pending_size_ > 0) {
+    out += replacement_char;
+    pending_size_ = 0;
+  }
+}
+
+std::string detokenize(const piece_table& table, const std::vector<int>& tokens) {
+  std::string text;
+  detokenizer detok(&table);
+  for (auto token: tokens) {
+    detok.append(token, text);
+  }
+  detok.finish(text);
+  return text;
+}
+
+}
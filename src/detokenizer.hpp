@@ -0,0 +1,62 @@
+#ifndef CGEMMA_DETOKENIZER_HPP
+#define CGEMMA_DETOKENIZER_HPP
+
+#include <gemma/gemma.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace cgemma {
+
+// The bytes of every token of a tokenizer, byte-fallback tokens map to the
+// raw byte and control tokens to nothing.
+class piece_table {
+public:
+  explicit piece_table(const gcpp::GemmaTokenizer& tokenizer);
+
+  size_t size() const { return offsets_.size() - 1; }
+  // Whether the tokenizer drops the leading space of the decoded text.
+  bool strip_leading_space() const { return strip_leading_space_; }
+
+  std::string_view piece(int token) const {
+    if (token < 0 || static_cast<size_t>(token) >= size()) {
+      return {};
+    }
+    return std::string_view(bytes_.data() + offsets_[token], offsets_[token + 1] - offsets_[token]);
+  }
+
+private:
+  std::string bytes_;
+  std::vector<uint32_t> offsets_;
+  bool strip_leading_space_ {false};
+};
+
+// Turns tokens into text incrementally, only complete UTF-8 sequences are
+// emitted and the bytes of a partial one are held back until it completes.
+class detokenizer {
+public:
+  explicit detokenizer(const piece_table* table = nullptr)
+    : table_(table) {
+    // nop
+  }
+
+  // Appends the text of `token` to `out`.
+  void append(int token, std::string& out);
+  // Appends a partial sequence held back at the end as a replacement
+  // character.
+  void finish(std::string& out);
+
+private:
+  const piece_table* table_;
+  char pending_[4];
+  size_t pending_size_ {0};
+  size_t expected_size_ {0};
+  bool at_start_ {true};
+};
+
+std::string detokenize(const piece_table& table, const std::vector<int>& tokens);
+
+}
+
+#endif  // CGEMMA_DETOKENIZER_HPP
@@ -0,0 +1,406 @@
+#include "engine.hpp"
+#include "instance.hpp"
+#include "session.hpp"
+#include "sampler.hpp"
+#include "grammar.hpp"
+#include "speculative.hpp"
+#include "utils/laux.hpp"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+
+namespace {
+
+constexpr const char name[] = "cgemma.engine";
+
+// An error of the stream function retires the query, as it is called while
+// generating.
+bool call_stream_fn(lua_State* L, cgemma::engine::query& q, size_t pos, const std::string* text) {
+  if (!q.error.empty()) {
+    return false;
+  }
+  lua_rawgeti(L, LUA_REGISTRYINDEX, q.stream_ref);
+  if (text) {
+    lua_pushlstring(L, text->data(), text->size());
+  } else {
+    lua_pushnil(L);
+  }
+  lua_pushinteger(L, pos - q.start_pos);
+  lua_pushinteger(L, q.prompt.size());
+  if (!cgemma::utils::pcall(L, 3, 1, q.error)) {
+    return false;
+  }
+  auto res = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  return res;
+}
+
+// Passes the text still buffered to the stream function of a query that
+// leaves the engine without a stream end.
+void flush_stream(lua_State* L, cgemma::engine::query& q, size_t pos) {
+  q.buf.finish();
+  if (!q.buf.text().empty()) {
+    call_stream_fn(L, q, pos, &q.buf.text());
+  }
+  q.buf.flush();
+}
+
+int submit(lua_State* L) {
+  auto eng = cgemma::engine::check(L, 1);
+  auto sess = cgemma::session::check(L, 2);
+  try {
+    cgemma::engine::query q;
+    q.sess = sess;
+    q.prompt = sess->read_prompt(L, 3, nullptr);
+    lua_pushvalue(L, 2);
+    q.sess_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (lua_isfunction(L, 4)) {
+      lua_pushvalue(L, 4);
+      q.stream_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+      q.stream_ref = LUA_NOREF;
+    }
+    auto sess_ref = q.sess_ref;
+    auto stream_ref = q.stream_ref;
+    try {
+      eng->submit(std::move(q));
+    } catch (...) {
+      luaL_unref(L, LUA_REGISTRYINDEX, sess_ref);
+      luaL_unref(L, LUA_REGISTRYINDEX, stream_ref);
+      throw;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int step(lua_State* L) {
+  auto eng = cgemma::engine::check(L, 1);
+  try {
+    auto finished = eng->step(L);
+    lua_createtable(L, 0, finished.size());
+    for (const auto& q: finished) {
+      lua_rawgeti(L, LUA_REGISTRYINDEX, q.sess_ref);
+      luaL_unref(L, LUA_REGISTRYINDEX, q.sess_ref);
+      luaL_unref(L, LUA_REGISTRYINDEX, q.stream_ref);
+      if (!q.error.empty()) {
+        lua_pushboolean(L, 0);
+      } else if (q.stream_ref != LUA_NOREF) {
+        lua_pushboolean(L, 1);
+      } else {
+        cgemma::push_output(L, q.sess, q.output);
+      }
+      lua_settable(L, -3);
+    }
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int pending(lua_State* L) {
+  lua_pushinteger(L, cgemma::engine::check(L, 1)->pending());
+  return 1;
+}
+
+int stats(lua_State* L) {
+  cgemma::push_timing(L, cgemma::engine::check(L, 1)->timing_info());
+  return 1;
+}
+
+int destroy(lua_State* L) {
+  auto eng = cgemma::engine::check(L, 1);
+  eng->release(L);
+  eng->~engine();
+  return 0;
+}
+
+}
+
+namespace cgemma {
+
+engine::engine(size_t max_queries, size_t round_tokens)
+  : max_queries_(max_queries)
+  , round_tokens_(round_tokens) {
+  // nop
+}
+
+void engine::submit(query&& q) {
+  if (pending() > 0 && q.sess->inst() != inst_) {
+    throw std::invalid_argument("Sessions in an engine must be created by the same cgemma instance.");
+  }
+  auto same_session = [&](const query& other) {
+    return other.sess == q.sess;
+  };
+  if (std::any_of(waiting_.begin(), waiting_.end(), same_session) || std::any_of(active_.begin(), active_.end(), same_session)) {
+    throw std::invalid_argument("Session already has a pending query.");
+  }
+  if (q.sess->busy()) {
+    throw std::invalid_argument("Session is busy.");
+  }
+  if (q.sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+    throw std::invalid_argument("PaliGemma models are not supported by the engine.");
+  }
+  if (!q.sess->context_shift() && q.sess->pos() >= q.sess->inst()->max_tokens()) {
+    throw std::invalid_argument("Session has ended.");
+  }
+  inst_ = q.sess->inst();
+  // The session is busy until its query is retired, so that it is neither
+  // changed nor spilled while it waits or runs.
+  q.sess->set_busy(true);
+  waiting_.push_back(std::move(q));
+}
+
+void engine::admit(query& q) {
+  // Room for the whole query is made upfront, so it is never shifted
+  // between rounds.
+  q.sess->make_room(q.prompt.size() + q.sess->args().max_generated_tokens);
+  q.start_pos = q.sess->pos();
+  auto cached = q.sess->restore_prefix(q.prompt);
+  q.feed.assign(q.prompt.begin() + cached, q.prompt.end());
+  q.feed_pos = q.start_pos + cached;
+  q.output.reserve(q.sess->args().max_generated_tokens);
+  q.buf = stream_buffer(q.sess->inst(), q.sess->stream_opts());
+  q.stop = stop_matcher(q.sess->inst(), q.sess->stop_opts());
+  if (q.sess->constraint()) {
+    q.grammar_state = q.sess->constraint()->initial();
+  }
+}
+
+gcpp::RuntimeConfig engine::round_config() {
+  gcpp::RuntimeConfig cfg;
+  cfg.max_generated_tokens = round_tokens_;
+  cfg.prefill_tbatch_size = 4096;
+  cfg.decode_qbatch_size = 4096;
+  cfg.temperature = 0.0f;
+  cfg.top_k = 1;
+  auto constrained = false;
+  for (const auto& q: active_) {
+    cfg.prefill_tbatch_size = std::min(cfg.prefill_tbatch_size, q.sess->args().prefill_tbatch_size);
+    cfg.decode_qbatch_size = std::min(cfg.decode_qbatch_size, q.sess->args().decode_qbatch_size);
+    cfg.top_k = std::max(cfg.top_k, q.sess->args().top_k);
+    constrained = constrained || q.sess->constraint() || !q.sess->filter().empty();
+  }
+  if (cfg.top_k > 1 || constrained) {
+    cfg.sample_func = [this](size_t query_idx, size_t, gcpp::Logits logits, size_t) {
+      auto& q = active_[query_idx];
+      auto g = q.sess->constraint().get();
+      if (g) {
+        g->mask(q.grammar_state, logits);
+      }
+      auto tp = sample(logits, q.sess->args().temperature, q.sess->args().top_k, q.sess->filter(), q.sess->rng());
+      if (g) {
+        q.grammar_state = g->advance(q.grammar_state, tp.token);
+      }
+      return tp;
+    };
+  }
+  cfg.verbosity = 0;
+  return cfg;
+}
+
+std::vector<engine::query> engine::step(lua_State* L) {
+  std::vector<query> finished;
+  while (!waiting_.empty() && active_.size() < max_queries_) {
+    auto& q = waiting_.front();
+    try {
+      admit(q);
+    } catch (const std::exception& e) {
+      // Retired right away, e.g. its prompt is too long to shift the context.
+      q.error = e.what();
+      q.done = true;
+      q.sess->set_busy(false);
+      finished.push_back(std::move(q));
+      waiting_.pop_front();
+      continue;
+    }
+    active_.push_back(std::move(q));
+    waiting_.pop_front();
+  }
+  if (active_.empty()) {
+    return finished;
+  }
+  auto cfg = round_config();
+  std::vector<int> last_tokens(active_.size());
+  std::vector<size_t> generated(active_.size());
+  cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int token, float) {
+    auto& q = active_[query_idx];
+    if (pos - q.feed_pos < q.feed.size()) {
+      // Prompt tokens are only reported in the first round.
+      if (!q.continued && q.stream_ref != LUA_NOREF && q.buf.prefill() && !call_stream_fn(L, q, pos, nullptr)) {
+        q.done = true;
+        return false;
+      }
+      q.sess->set_pos(pos);
+      return true;
+    }
+    if (inst_->eos(token)) {
+      if (q.stream_ref != LUA_NOREF) {
+        flush_stream(L, q, q.sess->pos());
+        call_stream_fn(L, q, pos, nullptr);
+      }
+      q.done = true;
+      return false;
+    }
+    q.output.push_back(token);
+    auto stopped = q.stop.push(token);
+    if (q.stream_ref != LUA_NOREF && (q.buf.push(token) || stopped)) {
+      if (stopped) {
+        q.buf.finish();
+      }
+      auto more = q.buf.text().empty() || call_stream_fn(L, q, pos, &q.buf.text());
+      q.buf.flush();
+      if (!more) {
+        q.done = true;
+        return false;
+      }
+    }
+    q.sess->set_pos(pos);
+    last_tokens[query_idx] = token;
+    ++generated[query_idx];
+    if (stopped) {
+      if (q.stream_ref != LUA_NOREF) {
+        call_stream_fn(L, q, pos, nullptr);
+      }
+      q.done = true;
+      return false;
+    }
+    if (++q.generated >= q.sess->args().max_generated_tokens) {
+      if (q.stream_ref != LUA_NOREF) {
+        flush_stream(L, q, pos);
+      }
+      q.done = true;
+      return false;
+    }
+    return true;
+  };
+  gcpp::AllQueries queries;
+  queries.Reserve(active_.size());
+  for (auto& q: active_) {
+    queries.Append(gcpp::PerQuery{
+      .prompt = gcpp::PromptTokens(q.feed.data(), q.feed.size()),
+      .mutable_pos = q.feed_pos,
+      .initial_pos = q.feed_pos,
+      .prefix_end = 0,
+      .kv_cache = q.sess->mutable_kv_cache()
+    });
+  }
+  if (inst_->kv_offload()) {
+    inst_->kv_offload()->trim(active_.size());
+  }
+  timing_ = gcpp::TimingInfo();
+  {
+    scheduler::generation_lock lock(inst_->sched());
+    inst_->model().GenerateBatch(cfg, queries, inst_->matmul_env(), timing_);
+  }
+  for (size_t i = 0; i < active_.size(); ++i) {
+    auto& q = active_[i];
+    if (q.done) {
+      continue;
+    }
+    // A query that made no progress has run out of its KV cache.
+    if (generated[i] == 0 || !q.sess->context_shift() && q.sess->pos() >= q.sess->capacity()) {
+      if (q.stream_ref != LUA_NOREF) {
+        flush_stream(L, q, q.sess->pos());
+      }
+      q.done = true;
+      continue;
+    }
+    q.feed.assign(1, last_tokens[i]);
+    q.feed_pos = q.sess->pos();
+    q.continued = true;
+  }
+  for (const auto& q: active_) {
+    if (q.done) {
+      q.sess->set_busy(false);
+      if (q.sess->spec()) {
+        q.sess->spec()->append(q.sess, q.start_pos, q.prompt, q.output);
+      }
+      if (q.start_pos == 0) {
+        q.sess->cache_prefix(q.prompt);
+      }
+    }
+  }
+  auto it = std::stable_partition(active_.begin(), active_.end(), [](const query& q) {
+    return !q.done;
+  });
+  std::move(it, active_.end(), std::back_inserter(finished));
+  active_.erase(it, active_.end());
+  return finished;
+}
+
+void engine::release(lua_State* L) {
+  auto unref = [&](const query& q) {
+    q.sess->set_busy(false);
+    luaL_unref(L, LUA_REGISTRYINDEX, q.sess_ref);
+    luaL_unref(L, LUA_REGISTRYINDEX, q.stream_ref);
+  };
+  std::for_each(waiting_.begin(), waiting_.end(), unref);
+  std::for_each(active_.begin(), active_.end(), unref);
+  waiting_.clear();
+  active_.clear();
+}
+
+void engine::declare(lua_State* L) {
+  constexpr const luaL_Reg metatable[] = {
+    {"__gc", destroy},
+    {nullptr, nullptr}
+  };
+  constexpr const luaL_Reg methods[] = {
+    {"submit", ::submit},
+    {"step", ::step},
+    {"pending", ::pending},
+    {"stats", stats},
+    {nullptr, nullptr}
+  };
+  luaL_newmetatable(L, name);
+  luaL_register(L, nullptr, metatable);
+  lua_pushlstring(L, name, sizeof(name) - 1);
+  lua_setfield(L, -2, "_NAME");
+  lua_newtable(L);
+  luaL_register(L, nullptr, methods);
+  lua_setfield(L, -2, "__index");
+}
+
+engine* engine::check(lua_State* L, int index) {
+  return static_cast<engine*>(luaL_checkudata(L, index, name));
+}
+
+int engine::create(lua_State* L) {
+  size_t max_queries = 64;
+  size_t round_tokens = 16;
+  if (lua_gettop(L) >= 1) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_getfield(L, 1, "max_queries");
+    if (!lua_isnil(L, -1)) {
+      auto v = lua_tointeger(L, -1);
+      if (v <= 0) {
+        luaL_argerror(L, 1, "max_queries must be positive");
+      }
+      max_queries = v;
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "round_tokens");
+    if (!lua_isnil(L, -1)) {
+      auto v = lua_tointeger(L, -1);
+      if (v <= 0) {
+        luaL_argerror(L, 1, "round_tokens must be positive");
+      }
+      round_tokens = v;
+    }
+    lua_pop(L, 1);
+  }
+  auto ud = lua_newuserdata(L, sizeof(engine));
+  new(ud) engine(max_queries, round_tokens);
+  luaL_getmetatable(L, name);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+}
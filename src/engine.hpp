@@ -0,0 +1,72 @@
+#ifndef CGEMMA_ENGINE_HPP
+#define CGEMMA_ENGINE_HPP
+
+#include "stream_buffer.hpp"
+#include "stop_matcher.hpp"
+#include <lua.hpp>
+#include <gemma/gemma.h>
+#include <vector>
+#include <deque>
+#include <string>
+
+namespace cgemma {
+
+class instance;
+class session;
+
+// Runs the queries submitted to it in rounds of `GenerateBatch`, each round
+// decodes at most `round_tokens` tokens. Finished queries are retired and
+// waiting ones are admitted into the free slots between rounds.
+class engine {
+public:
+  struct query {
+    session* sess;
+    int sess_ref;
+    int stream_ref;
+    std::vector<int> prompt;
+    size_t start_pos {0};
+    // Tokens fed to the model in the current round and where they start, a
+    // query that is carried over to the next round is fed its last token.
+    std::vector<int> feed;
+    size_t feed_pos {0};
+    bool continued {false};
+    std::vector<int> output;
+    stream_buffer buf;
+    stop_matcher stop;
+    int grammar_state {0};
+    size_t generated {0};
+    bool done {false};
+    // Why the query was retired early, if it was.
+    std::string error;
+  };
+
+  engine(size_t max_queries, size_t round_tokens);
+
+  size_t pending() const { return waiting_.size() + active_.size(); }
+  const gcpp::TimingInfo& timing_info() const { return timing_; }
+
+  void submit(query&& q);
+  // Runs a round, returns the queries finished in it.
+  std::vector<query> step(lua_State* L);
+  // Releases the references to the sessions and stream functions.
+  void release(lua_State* L);
+
+  static void declare(lua_State* L);
+  static engine* check(lua_State* L, int index);
+  static int create(lua_State* L);
+
+private:
+  void admit(query& q);
+  gcpp::RuntimeConfig round_config();
+
+  size_t max_queries_;
+  size_t round_tokens_;
+  instance* inst_ {nullptr};
+  std::deque<query> waiting_;
+  std::vector<query> active_;
+  gcpp::TimingInfo timing_;
+};
+
+}
+
+#endif  // CGEMMA_ENGINE_HPP
@@ -0,0 +1,750 @@
+#include "grammar.hpp"
+#include "instance.hpp"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace {
+
+constexpr const char name[] = "cgemma.grammar";
+// Deeper nesting is not matched, which also stops left recursion.
+constexpr const size_t max_stack_depth = 256;
+constexpr const cgemma::grammar::state dead = -1;
+constexpr const cgemma::grammar::state unknown = -2;
+constexpr const uint32_t max_code_point = 0x10FFFF;
+constexpr const size_t unbounded = std::numeric_limits<size_t>::max();
+
+using byte_ranges = std::vector<std::pair<uint8_t, uint8_t>>;
+
+struct expr {
+  enum kind_t {
+    seq,
+    alt,
+    bytes,
+    chars,
+    ref,
+    repeat
+  };
+
+  kind_t kind;
+  std::vector<expr> children;
+  std::string text;
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  int rule {-1};
+  size_t min {0};
+  size_t max {0};
+};
+
+void encode_utf8(uint32_t cp, std::string& out) {
+  if (cp < 0x80) {
+    out.push_back(static_cast<char>(cp));
+  } else if (cp < 0x800) {
+    out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+  }
+}
+
+// Splits the code points in [lo, hi] into sequences of byte ranges matching
+// exactly their UTF-8 encodings.
+void utf8_sequences(uint32_t lo, uint32_t hi, std::vector<byte_ranges>& out) {
+  constexpr const uint32_t boundaries[] = {0x7F, 0x7FF, 0xFFFF};
+  for (auto b: boundaries) {
+    if (lo <= b && hi > b) {
+      utf8_sequences(lo, b, out);
+      utf8_sequences(b + 1, hi, out);
+      return;
+    }
+  }
+  std::string lo_bytes;
+  std::string hi_bytes;
+  encode_utf8(lo, lo_bytes);
+  encode_utf8(hi, hi_bytes);
+  for (size_t i = 1; i < lo_bytes.size(); ++i) {
+    uint32_t m = (1u << (6 * i)) - 1;
+    if ((lo & ~m) != (hi & ~m)) {
+      if ((lo & m) != 0) {
+        utf8_sequences(lo, lo | m, out);
+        utf8_sequences((lo | m) + 1, hi, out);
+        return;
+      }
+      if ((hi & m) != m) {
+        utf8_sequences(lo, (hi & ~m) - 1, out);
+        utf8_sequences(hi & ~m, hi, out);
+        return;
+      }
+    }
+  }
+  byte_ranges seq;
+  for (size_t i = 0; i < lo_bytes.size(); ++i) {
+    seq.emplace_back(static_cast<uint8_t>(lo_bytes[i]), static_cast<uint8_t>(hi_bytes[i]));
+  }
+  out.push_back(std::move(seq));
+}
+
+class parser {
+public:
+  explicit parser(std::string_view text)
+    : text_(text) {
+    // nop
+  }
+
+  size_t rules() const { return bodies_.size(); }
+  const expr& body(int rule) const { return bodies_[rule]; }
+
+  int parse() {
+    skip(true);
+    while (pos_ < text_.size()) {
+      auto id = rule_id(parse_name());
+      skip(false);
+      if (text_.compare(pos_, 3, "::=") != 0) {
+        error("expected ::=");
+      }
+      pos_ += 3;
+      skip(true);
+      if (defined_[id]) {
+        error("duplicate rule");
+      }
+      bodies_[id] = parse_alt(false);
+      defined_[id] = true;
+      skip(false);
+      if (pos_ < text_.size() && text_[pos_] != '\n') {
+        error("unexpected character");
+      }
+      skip(true);
+    }
+    for (size_t i = 0; i < defined_.size(); ++i) {
+      if (!defined_[i]) {
+        throw std::invalid_argument("Grammar error: undefined rule " + names_[i]);
+      }
+    }
+    auto it = ids_.find("root");
+    if (it == ids_.end()) {
+      throw std::invalid_argument("Grammar error: no root rule");
+    }
+    return it->second;
+  }
+
+private:
+  [[noreturn]] void error(const char* what) const {
+    auto line = std::count(text_.begin(), text_.begin() + std::min(pos_, text_.size()), '\n') + 1;
+    throw std::invalid_argument("Grammar error at line " + std::to_string(line) + ": " + what);
+  }
+
+  char peek() const { return pos_ < text_.size() ? text_[pos_] : '\0'; }
+
+  void skip(bool newline_ok) {
+    while (pos_ < text_.size()) {
+      auto c = text_[pos_];
+      if (c == '#') {
+        while (pos_ < text_.size() && text_[pos_] != '\n') {
+          ++pos_;
+        }
+      } else if (c == ' ' || c == '\t' || c == '\r' || (newline_ok && c == '\n')) {
+        ++pos_;
+      } else {
+        break;
+      }
+    }
+  }
+
+  static bool is_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '-';
+  }
+
+  std::string parse_name() {
+    auto start = pos_;
+    while (pos_ < text_.size() && is_name_char(text_[pos_])) {
+      ++pos_;
+    }
+    if (pos_ == start) {
+      error("expected a rule name");
+    }
+    return std::string(text_.substr(start, pos_ - start));
+  }
+
+  int rule_id(const std::string& name) {
+    auto it = ids_.find(name);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+    int id = bodies_.size();
+    ids_.emplace(name, id);
+    names_.push_back(name);
+    bodies_.emplace_back();
+    defined_.push_back(false);
+    return id;
+  }
+
+  uint32_t parse_hex(size_t digits) {
+    uint32_t cp = 0;
+    for (size_t i = 0; i < digits; ++i, ++pos_) {
+      auto c = peek();
+      cp <<= 4;
+      if (c >= '0' && c <= '9') {
+        cp |= c - '0';
+      } else if (c >= 'a' && c <= 'f') {
+        cp |= c - 'a' + 10;
+      } else if (c >= 'A' && c <= 'F') {
+        cp |= c - 'A' + 10;
+      } else {
+        error("invalid hex escape");
+      }
+    }
+    return cp;
+  }
+
+  // Parses a possibly escaped character into a code point.
+  uint32_t parse_char() {
+    if (pos_ >= text_.size()) {
+      error("unexpected end of grammar");
+    }
+    auto c = static_cast<unsigned char>(text_[pos_++]);
+    if (c == '\\') {
+      auto e = peek();
+      ++pos_;
+      switch (e) {
+        case 'n': return '\n';
+        case 'r': return '\r';
+        case 't': return '\t';
+        case 'x': return parse_hex(2);
+        case 'u': return parse_hex(4);
+        case 'U': return parse_hex(8);
+        case '\\': case '"': case '\'': case '[': case ']': case '-': case '^': return e;
+        default: error("invalid escape");
+      }
+    }
+    if (c < 0x80) {
+      return c;
+    }
+    size_t n = (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : 0;
+    if (n == 0 || pos_ + n > text_.size()) {
+      error("invalid UTF-8");
+    }
+    uint32_t cp = c & (0x3F >> n);
+    for (size_t i = 0; i < n; ++i) {
+      cp = (cp << 6) | (static_cast<unsigned char>(text_[pos_++]) & 0x3F);
+    }
+    return cp;
+  }
+
+  expr parse_literal() {
+    ++pos_;
+    expr e {expr::bytes};
+    while (peek() != '"') {
+      if (pos_ >= text_.size() || peek() == '\n') {
+        error("unterminated string");
+      }
+      encode_utf8(parse_char(), e.text);
+    }
+    ++pos_;
+    return e;
+  }
+
+  expr parse_class() {
+    ++pos_;
+    auto negated = peek() == '^';
+    if (negated) {
+      ++pos_;
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> ranges;
+    while (peek() != ']') {
+      if (pos_ >= text_.size() || peek() == '\n') {
+        error("unterminated character class");
+      }
+      auto lo = parse_char();
+      auto hi = lo;
+      if (peek() == '-' && pos_ + 1 < text_.size() && text_[pos_ + 1] != ']') {
+        ++pos_;
+        hi = parse_char();
+      }
+      if (hi < lo) {
+        error("invalid character range");
+      }
+      ranges.emplace_back(lo, hi);
+    }
+    ++pos_;
+    std::sort(ranges.begin(), ranges.end());
+    expr e {expr::chars};
+    for (const auto& r: ranges) {
+      if (!e.ranges.empty() && r.first <= e.ranges.back().second + 1) {
+        e.ranges.back().second = std::max(e.ranges.back().second, r.second);
+      } else {
+        e.ranges.push_back(r);
+      }
+    }
+    if (negated) {
+      std::vector<std::pair<uint32_t, uint32_t>> complement;
+      uint32_t next = 0;
+      for (const auto& r: e.ranges) {
+        if (r.first > next) {
+          complement.emplace_back(next, r.first - 1);
+        }
+        next = r.second + 1;
+      }
+      if (next <= max_code_point) {
+        complement.emplace_back(next, max_code_point);
+      }
+      e.ranges = std::move(complement);
+    }
+    return e;
+  }
+
+  size_t parse_count() {
+    auto start = pos_;
+    size_t n = 0;
+    while (peek() >= '0' && peek() <= '9') {
+      n = n * 10 + (text_[pos_++] - '0');
+    }
+    if (pos_ == start) {
+      error("expected a number");
+    }
+    return n;
+  }
+
+  expr parse_primary() {
+    auto c = peek();
+    if (c == '"') {
+      return parse_literal();
+    } else if (c == '[') {
+      return parse_class();
+    } else if (c == '(') {
+      ++pos_;
+      skip(true);
+      auto e = parse_alt(true);
+      skip(true);
+      if (peek() != ')') {
+        error("expected )");
+      }
+      ++pos_;
+      return e;
+    } else if (c == '.') {
+      ++pos_;
+      expr e {expr::chars};
+      e.ranges.emplace_back(0, max_code_point);
+      return e;
+    } else if (is_name_char(c)) {
+      expr e {expr::ref};
+      e.rule = rule_id(parse_name());
+      return e;
+    }
+    error("unexpected character");
+  }
+
+  expr parse_postfix(expr e) {
+    for (;;) {
+      size_t min;
+      size_t max;
+      auto c = peek();
+      if (c == '*') {
+        ++pos_;
+        min = 0;
+        max = unbounded;
+      } else if (c == '+') {
+        ++pos_;
+        min = 1;
+        max = unbounded;
+      } else if (c == '?') {
+        ++pos_;
+        min = 0;
+        max = 1;
+      } else if (c == '{') {
+        ++pos_;
+        skip(false);
+        min = parse_count();
+        max = min;
+        skip(false);
+        if (peek() == ',') {
+          ++pos_;
+          skip(false);
+          max = peek() == '}' ? unbounded : parse_count();
+          skip(false);
+        }
+        if (peek() != '}' || max < min) {
+          error("invalid repetition");
+        }
+        ++pos_;
+      } else {
+        return e;
+      }
+      expr r {expr::repeat};
+      r.min = min;
+      r.max = max;
+      r.children.push_back(std::move(e));
+      e = std::move(r);
+    }
+  }
+
+  expr parse_seq(bool nested) {
+    expr e {expr::seq};
+    for (;;) {
+      skip(nested);
+      auto c = peek();
+      if (pos_ >= text_.size() || c == '|' || c == ')' || c == '\n') {
+        break;
+      }
+      e.children.push_back(parse_postfix(parse_primary()));
+    }
+    return e;
+  }
+
+  expr parse_alt(bool nested) {
+    expr e {expr::alt};
+    e.children.push_back(parse_seq(nested));
+    for (;;) {
+      // An alternative may continue on the next line.
+      auto save = pos_;
+      skip(true);
+      if (peek() != '|') {
+        pos_ = save;
+        break;
+      }
+      ++pos_;
+      skip(true);
+      e.children.push_back(parse_seq(nested));
+    }
+    return e.children.size() == 1 ? std::move(e.children.front()) : e;
+  }
+
+  std::string_view text_;
+  size_t pos_ {0};
+  std::unordered_map<std::string, int> ids_;
+  std::vector<std::string> names_;
+  std::vector<expr> bodies_;
+  std::vector<bool> defined_;
+};
+
+using node = cgemma::grammar::node;
+
+int add_node(std::vector<node>& nodes, node n) {
+  nodes.push_back(std::move(n));
+  return nodes.size() - 1;
+}
+
+int add_range(std::vector<node>& nodes, uint8_t lo, uint8_t hi, int next) {
+  node n {node::range};
+  n.lo = lo;
+  n.hi = hi;
+  n.next = next;
+  return add_node(nodes, std::move(n));
+}
+
+int add_split(std::vector<node>& nodes, std::vector<int> targets) {
+  node n {node::split};
+  n.targets = std::move(targets);
+  return add_node(nodes, std::move(n));
+}
+
+// Compiles `e` backwards, it moves on to `next` once matched.
+int compile(const expr& e, int next, std::vector<node>& nodes) {
+  switch (e.kind) {
+    case expr::bytes:
+      for (auto it = e.text.rbegin(); it != e.text.rend(); ++it) {
+        next = add_range(nodes, static_cast<uint8_t>(*it), static_cast<uint8_t>(*it), next);
+      }
+      return next;
+    case expr::chars: {
+      std::vector<byte_ranges> seqs;
+      for (const auto& r: e.ranges) {
+        utf8_sequences(r.first, r.second, seqs);
+      }
+      std::vector<int> starts;
+      for (const auto& seq: seqs) {
+        auto start = next;
+        for (auto it = seq.rbegin(); it != seq.rend(); ++it) {
+          start = add_range(nodes, it->first, it->second, start);
+        }
+        starts.push_back(start);
+      }
+      return starts.size() == 1 ? starts.front() : add_split(nodes, std::move(starts));
+    }
+    case expr::seq:
+      for (auto it = e.children.rbegin(); it != e.children.rend(); ++it) {
+        next = compile(*it, next, nodes);
+      }
+      return next;
+    case expr::alt: {
+      std::vector<int> targets;
+      for (const auto& child: e.children) {
+        targets.push_back(compile(child, next, nodes));
+      }
+      return add_split(nodes, std::move(targets));
+    }
+    case expr::ref: {
+      node n {node::call};
+      n.rule = e.rule;
+      n.next = next;
+      return add_node(nodes, std::move(n));
+    }
+    case expr::repeat: {
+      const auto& child = e.children.front();
+      auto tail = next;
+      if (e.max == unbounded) {
+        auto loop = add_split(nodes, {});
+        auto body = compile(child, loop, nodes);
+        nodes[loop].targets = {body, next};
+        tail = loop;
+      } else {
+        for (auto i = e.min; i < e.max; ++i) {
+          auto body = compile(child, tail, nodes);
+          tail = add_split(nodes, {body, next});
+        }
+      }
+      for (size_t i = 0; i < e.min; ++i) {
+        tail = compile(child, tail, nodes);
+      }
+      return tail;
+    }
+  }
+  return next;
+}
+
+int destroy(lua_State* L) {
+  static_cast<std::shared_ptr<cgemma::grammar>*>(luaL_checkudata(L, 1, name))->~shared_ptr();
+  return 0;
+}
+
+}
+
+namespace cgemma {
+
+grammar::grammar(const instance* inst, std::string_view text)
+  : inst_(inst) {
+  parser p(text);
+  auto root = p.parse();
+  auto ret = add_node(nodes_, node {node::ret});
+  rule_starts_.resize(p.rules());
+  for (size_t i = 0; i < p.rules(); ++i) {
+    rule_starts_[i] = compile(p.body(i), ret, nodes_);
+  }
+  stacks_.emplace_back(-1, -1);
+  stack_depths_.push_back(0);
+  std::vector<std::pair<int, int>> work {{rule_starts_[root], 0}};
+  initial_ = make_config(work);
+
+  const auto& pieces = inst->pieces();
+  eos_mask_.resize((pieces.size() + 63) / 64);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    int token = i;
+    if (inst->eos(token)) {
+      eos_tokens_.push_back(token);
+      eos_mask_[i / 64] |= uint64_t(1) << (i % 64);
+    } else if (!pieces.piece(token).empty()) {
+      sorted_tokens_.push_back(token);
+    }
+  }
+  std::sort(sorted_tokens_.begin(), sorted_tokens_.end(), [&](int lhs, int rhs) {
+    return pieces.piece(lhs) < pieces.piece(rhs);
+  });
+}
+
+void grammar::mask(state s, gcpp::Logits logits) {
+  std::lock_guard<std::mutex> lock(mtx_);
+  const auto& m = s == dead ? eos_mask_ : mask_of(s);
+  constexpr auto ninf = -std::numeric_limits<float>::infinity();
+  auto n = logits.size();
+  for (size_t w = 0; w * 64 < n; ++w) {
+    auto bits = w < m.size() ? m[w] : 0;
+    if (bits == ~uint64_t(0)) {
+      continue;
+    }
+    auto end = std::min(n, w * 64 + 64);
+    for (auto i = w * 64; i < end; ++i) {
+      if (!((bits >> (i % 64)) & 1)) {
+        logits[i] = ninf;
+      }
+    }
+  }
+}
+
+grammar::state grammar::advance(state s, int token) {
+  if (s == dead || inst_->eos(token)) {
+    return s;
+  }
+  std::lock_guard<std::mutex> lock(mtx_);
+  for (auto c: inst_->pieces().piece(token)) {
+    s = step(s, static_cast<uint8_t>(c));
+    if (s == dead) {
+      break;
+    }
+  }
+  return s;
+}
+
+int grammar::push_stack(int parent, int ret) {
+  auto key = (static_cast<uint64_t>(parent) << 32) | static_cast<uint32_t>(ret);
+  auto it = stack_index_.find(key);
+  if (it != stack_index_.end()) {
+    return it->second;
+  }
+  int id = stacks_.size();
+  stacks_.emplace_back(parent, ret);
+  stack_depths_.push_back(stack_depths_[parent] + 1);
+  stack_index_.emplace(key, id);
+  return id;
+}
+
+grammar::state grammar::make_config(std::vector<std::pair<int, int>>& work) {
+  std::vector<std::pair<int, int>> items;
+  auto accept = false;
+  std::unordered_set<uint64_t> visited;
+  while (!work.empty()) {
+    auto [n, s] = work.back();
+    work.pop_back();
+    if (!visited.insert((static_cast<uint64_t>(n) << 32) | static_cast<uint32_t>(s)).second) {
+      continue;
+    }
+    const auto& nd = nodes_[n];
+    switch (nd.kind) {
+      case node::range:
+        items.emplace_back(n, s);
+        break;
+      case node::split:
+        for (auto t: nd.targets) {
+          work.emplace_back(t, s);
+        }
+        break;
+      case node::call:
+        if (stack_depths_[s] < max_stack_depth) {
+          work.emplace_back(rule_starts_[nd.rule], push_stack(s, nd.next));
+        }
+        break;
+      case node::ret:
+        if (s == 0) {
+          accept = true;
+        } else {
+          work.emplace_back(stacks_[s].second, stacks_[s].first);
+        }
+        break;
+    }
+  }
+  if (items.empty() && !accept) {
+    return dead;
+  }
+  std::sort(items.begin(), items.end());
+  std::vector<uint64_t> key;
+  key.reserve(items.size() + 1);
+  for (const auto& item: items) {
+    key.push_back((static_cast<uint64_t>(item.first) << 32) | static_cast<uint32_t>(item.second));
+  }
+  if (accept) {
+    key.push_back(~uint64_t(0));
+  }
+  auto it = config_index_.find(key);
+  if (it != config_index_.end()) {
+    return it->second;
+  }
+  state id = configs_.size();
+  configs_.emplace_back();
+  auto& c = configs_.back();
+  c.items = std::move(items);
+  c.accept = accept;
+  c.next.fill(unknown);
+  config_index_.emplace(std::move(key), id);
+  return id;
+}
+
+grammar::state grammar::step(state s, uint8_t byte) {
+  // Elements of a deque stay in place when more are added.
+  auto& next = configs_[s].next[byte];
+  if (next != unknown) {
+    return next;
+  }
+  std::vector<std::pair<int, int>> work;
+  for (const auto& item: configs_[s].items) {
+    const auto& nd = nodes_[item.first];
+    if (byte >= nd.lo && byte <= nd.hi) {
+      work.emplace_back(nd.next, item.second);
+    }
+  }
+  next = work.empty() ? dead : make_config(work);
+  return next;
+}
+
+const std::vector<uint64_t>& grammar::mask_of(state s) {
+  if (configs_[s].mask.empty()) {
+    std::vector<uint64_t> mask(eos_mask_.size());
+    walk(s, 0, 0, sorted_tokens_.size(), mask);
+    auto empty = std::all_of(mask.begin(), mask.end(), [](uint64_t w) { return w == 0; });
+    if (configs_[s].accept || empty) {
+      for (size_t i = 0; i < mask.size(); ++i) {
+        mask[i] |= eos_mask_[i];
+      }
+    }
+    configs_[s].mask = std::move(mask);
+  }
+  return configs_[s].mask;
+}
+
+void grammar::walk(state s, size_t depth, size_t begin, size_t end, std::vector<uint64_t>& mask) {
+  // Tokens in [begin, end) share their first `depth` bytes, which lead to
+  // `s`. Shorter pieces sort first, so the tokens ending here lead the range.
+  const auto& pieces = inst_->pieces();
+  auto i = begin;
+  for (; i < end && pieces.piece(sorted_tokens_[i]).size() == depth; ++i) {
+    auto token = sorted_tokens_[i];
+    mask[token / 64] |= uint64_t(1) << (token % 64);
+  }
+  while (i < end) {
+    auto byte = static_cast<uint8_t>(pieces.piece(sorted_tokens_[i])[depth]);
+    auto j = i + 1;
+    while (j < end && static_cast<uint8_t>(pieces.piece(sorted_tokens_[j])[depth]) == byte) {
+      ++j;
+    }
+    auto next = step(s, byte);
+    if (next != dead) {
+      walk(next, depth + 1, i, j, mask);
+    }
+    i = j;
+  }
+}
+
+void grammar::declare(lua_State* L) {
+  constexpr const luaL_Reg metatable[] = {
+    {"__gc", destroy},
+    {nullptr, nullptr}
+  };
+  constexpr const luaL_Reg methods[] = {
+    {nullptr, nullptr}
+  };
+  luaL_newmetatable(L, name);
+  luaL_register(L, nullptr, metatable);
+  lua_pushlstring(L, name, sizeof(name) - 1);
+  lua_setfield(L, -2, "_NAME");
+  lua_newtable(L);
+  luaL_register(L, nullptr, methods);
+  lua_setfield(L, -2, "__index");
+}
+
+const std::shared_ptr<grammar>& grammar::check(lua_State* L, int index) {
+  return *static_cast<std::shared_ptr<grammar>*>(luaL_checkudata(L, index, name));
+}
+
+int grammar::create(lua_State* L) {
+  auto inst = instance::check(L, 1);
+  size_t len;
+  auto text = luaL_checklstring(L, 2, &len);
+  auto ud = lua_newuserdata(L, sizeof(std::shared_ptr<grammar>));
+  try {
+    new(ud) std::shared_ptr<grammar>(std::make_shared<grammar>(inst, std::string_view(text, len)));
+    luaL_getmetatable(L, name);
+    lua_setmetatable(L, -2);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+}
@@ -0,0 +1,102 @@
+#ifndef CGEMMA_GRAMMAR_HPP
+#define CGEMMA_GRAMMAR_HPP
+
+#include <lua.hpp>
+#include <gemma/gemma.h>
+#include <gemma/gemma_args.h>
+#include <array>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+namespace cgemma {
+
+class instance;
+
+// A GBNF-style grammar compiled for the vocabulary of an instance. Rules are
+// compiled to a byte-level automaton, whose states are the sets of positions
+// in the rules together with the stacks of rules they were reached from.
+// States and the masks of the tokens allowed in them are built lazily while
+// decoding, and shared by all sessions using the grammar.
+class grammar {
+public:
+  using state = int;
+
+  grammar(const instance* inst, std::string_view text);
+
+  const instance* inst() const { return inst_; }
+  state initial() const { return initial_; }
+
+  // Sets the logits of the tokens not allowed in `s` to -inf, end of
+  // sequence tokens are allowed once the root rule is complete.
+  void mask(state s, gcpp::Logits logits);
+  // Returns the state after `token` is generated in `s`.
+  state advance(state s, int token);
+
+  static void declare(lua_State* L);
+  static const std::shared_ptr<grammar>& check(lua_State* L, int index);
+  static int create(lua_State* L);
+
+  // A position in the rules.
+  struct node {
+    enum kind_t: uint8_t {
+      // Consumes a byte in [lo, hi] and moves on to `next`.
+      range,
+      // Moves on to all of `targets` without consuming anything.
+      split,
+      // Enters `rule`, and moves on to `next` when it is complete.
+      call,
+      // Completes the current rule.
+      ret
+    };
+
+    kind_t kind;
+    uint8_t lo {0};
+    uint8_t hi {0};
+    int next {-1};
+    int rule {-1};
+    std::vector<int> targets;
+  };
+
+private:
+  struct config {
+    // Positions consuming a byte next, with the stacks they were reached from.
+    std::vector<std::pair<int, int>> items;
+    bool accept {false};
+    std::array<state, 256> next;
+    std::vector<uint64_t> mask;
+  };
+
+  int push_stack(int parent, int ret);
+  state make_config(std::vector<std::pair<int, int>>& work);
+  state step(state s, uint8_t byte);
+  const std::vector<uint64_t>& mask_of(state s);
+  void walk(state s, size_t depth, size_t begin, size_t end, std::vector<uint64_t>& mask);
+
+  const instance* inst_;
+  std::vector<node> nodes_;
+  std::vector<int> rule_starts_;
+  // Interned stacks, each entry is its parent and the position to return to.
+  std::vector<std::pair<int, int>> stacks_;
+  std::vector<size_t> stack_depths_;
+  std::unordered_map<uint64_t, int> stack_index_;
+  std::deque<config> configs_;
+  std::map<std::vector<uint64_t>, state> config_index_;
+  state initial_;
+  // Tokens with a non-empty piece sorted by their pieces, which makes them a
+  // flattened token trie.
+  std::vector<int> sorted_tokens_;
+  std::vector<int> eos_tokens_;
+  std::vector<uint64_t> eos_mask_;
+  std::mutex mtx_;
+};
+
+}
+
+#endif  // CGEMMA_GRAMMAR_HPP
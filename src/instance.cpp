@@ -1,6 +1,7 @@
 #include "instance.hpp"
 #include "image_tokens.hpp"
 #include "session.hpp"
+#include "grammar.hpp"
 #include <stdexcept>
 
 namespace {
@@ -16,7 +17,7 @@ int disabled_tokens(lua_State* L) {
   auto inst = cgemma::instance::check(L, 1);
   lua_newtable(L);
   size_t index = 0;
-  for (auto token: inst->disabled_tokens()) {
+  for (auto token: inst->filter()->disabled_tokens()) {
     std::string token_text;
     if (!inst->model().Tokenizer().Decode(std::vector<int>{token}, &token_text)) {
       throw std::runtime_error("Tokenizer decoding failed. (disabled_tokens)");
@@ -28,6 +29,76 @@ int disabled_tokens(lua_State* L) {
   return 1;
 }
 
+int tokenize(lua_State* L) {
+  auto inst = cgemma::instance::check(L, 1);
+  size_t len;
+  auto text = luaL_checklstring(L, 2, &len);
+  try {
+    auto tokens = inst->encode(text, len);
+    lua_createtable(L, tokens.size(), 0);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+      lua_pushinteger(L, tokens[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int detokenize(lua_State* L) {
+  auto inst = cgemma::instance::check(L, 1);
+  try {
+    auto text = cgemma::detokenize(inst->pieces(), inst->read_tokens(L, 2));
+    lua_pushlstring(L, text.data(), text.size());
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int kv_pool_stats(lua_State* L) {
+  auto inst = cgemma::instance::check(L, 1);
+  if (!inst->kv_pool()) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  lua_pushinteger(L, inst->kv_pool()->capacity());
+  lua_setfield(L, -2, "capacity");
+  lua_pushinteger(L, inst->kv_pool()->seq_len());
+  lua_setfield(L, -2, "seq_len");
+  lua_pushinteger(L, inst->kv_pool()->size());
+  lua_setfield(L, -2, "idle");
+  lua_pushinteger(L, inst->kv_pool()->hits());
+  lua_setfield(L, -2, "hits");
+  lua_pushinteger(L, inst->kv_pool()->misses());
+  lua_setfield(L, -2, "misses");
+  return 1;
+}
+
+int kv_offload_stats(lua_State* L) {
+  auto inst = cgemma::instance::check(L, 1);
+  if (!inst->kv_offload()) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  lua_pushinteger(L, inst->kv_offload()->budget());
+  lua_setfield(L, -2, "budget");
+  lua_pushinteger(L, inst->kv_offload()->resident_bytes());
+  lua_setfield(L, -2, "resident_bytes");
+  lua_pushinteger(L, inst->kv_offload()->resident_sessions());
+  lua_setfield(L, -2, "resident_sessions");
+  lua_pushinteger(L, inst->kv_offload()->spills());
+  lua_setfield(L, -2, "spills");
+  return 1;
+}
+
 }
 
 namespace cgemma {
@@ -44,6 +115,8 @@ instance::instance(int argc, char* argv[], scheduler* sched)
   infa.prefill_tbatch_size = 0;
   infa.decode_qbatch_size = 0;
   model_ = std::make_unique<gcpp::Gemma>(args_, infa, threading_ctx());
+  pieces_ = std::make_unique<cgemma::piece_table>(model_->Tokenizer());
+  filter_ = std::make_shared<cgemma::token_filter>(pieces_->size());
 }
 
 bool instance::instruction_tuned() const {
@@ -60,6 +133,44 @@ bool instance::eos(int token) const {
   return token == model_->Config().eos_id || instruction_tuned() && token == model_->Config().secondary_eos_id;
 }
 
+std::vector<int> instance::encode(const char* text, size_t len) const {
+  std::vector<int> tokens;
+  if (!model_->Tokenizer().Encode(std::string(text, len), &tokens)) {
+    throw std::runtime_error("Tokenizer encoding failed. (instance::encode)");
+  }
+  return tokens;
+}
+
+std::vector<int> instance::read_tokens(lua_State* L, int index) const {
+  if (!lua_istable(L, index)) {
+    throw std::invalid_argument("Tokens must be an array of token IDs.");
+  }
+  std::vector<int> tokens;
+  auto n = lua_objlen(L, index);
+  tokens.reserve(n);
+  for (size_t i = 1; i <= n; ++i) {
+    lua_rawgeti(L, index, i);
+    if (!lua_isnumber(L, -1)) {
+      lua_pop(L, 1);
+      throw std::invalid_argument("Tokens must be an array of token IDs.");
+    }
+    auto token = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (token < 0 || static_cast<size_t>(token) >= pieces_->size()) {
+      throw std::invalid_argument("Token ID out of range.");
+    }
+    tokens.push_back(token);
+  }
+  return tokens;
+}
+
+std::shared_ptr<gcpp::KVCache> instance::new_kv_cache(const gcpp::InferenceArgs& args) const {
+  if (kv_pool_) {
+    return kv_pool_->acquire(args);
+  }
+  return std::make_shared<gcpp::KVCache>(model_->Config(), args, threading_ctx().allocator);
+}
+
 void instance::declare(lua_State* L) {
   constexpr const luaL_Reg metatable[] = {
     {"__gc", destroy},
@@ -67,8 +178,13 @@ void instance::declare(lua_State* L) {
   };
   constexpr const luaL_Reg methods[] = {
     {"disabled_tokens", ::disabled_tokens},
+    {"tokenize", tokenize},
+    {"detokenize", ::detokenize},
+    {"kv_pool_stats", kv_pool_stats},
+    {"kv_offload_stats", kv_offload_stats},
     {"embed_image", image_tokens::create},
     {"session", session::create},
+    {"grammar", grammar::create},
     {nullptr, nullptr}
   };
   luaL_newmetatable(L, name);
@@ -121,24 +237,41 @@ int instance::create(lua_State* L) {
     auto inst = new(ud) instance(argc, argv, sched);
     luaL_getmetatable(L, name);
     lua_setmetatable(L, -2);
-    lua_getfield(L, 1, "disabled_words");
-    if (lua_istable(L, -1)) {
-      lua_pushnil(L);
-      while (lua_next(L, -2)) {
-        auto word = lua_tostring(L, -1);
-        if (word) {
-          std::vector<int> tokens;
-          if (!inst->model_->Tokenizer().Encode(word, &tokens)) {
-            throw std::runtime_error("Tokenizer encoding failed. (instance::create)");
-          }
-          for (auto t: tokens) {
-            inst->disabled_tokens_.insert(t);
-          }
-        }
-        lua_pop(L, 1);
+    auto filter = std::make_shared<cgemma::token_filter>(inst->pieces().size());
+    if (read_filter_options(L, 1, inst, *filter)) {
+      inst->filter_ = std::move(filter);
+    }
+    lua_getfield(L, 1, "prefix_cache");
+    auto prefix_cache_size = lua_tointeger(L, -1);
+    if (prefix_cache_size > 0) {
+      inst->prefix_cache_ = std::make_unique<cgemma::prefix_cache>(prefix_cache_size);
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 1, "kv_pool");
+    auto kv_pool_size = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (kv_pool_size > 0) {
+      char* pool_argv[3] = {const_cast<char*>("lua-cgemma")};
+      auto pool_argc = 1;
+      lua_getfield(L, 1, "kv_pool_seq_len");
+      auto v = lua_tostring(L, -1);
+      if (v) {
+        pool_argv[pool_argc++] = const_cast<char*>("--seq_len");
+        pool_argv[pool_argc++] = const_cast<char*>(v);
       }
+      gcpp::InferenceArgs pool_args(pool_argc, pool_argv);
+      lua_pop(L, 1);
+      inst->kv_pool_ = std::make_unique<cgemma::kv_pool>(inst->model_->Config(), pool_args, inst->threading_ctx(), kv_pool_size);
     }
+    lua_getfield(L, 1, "kv_budget");
+    auto kv_budget = lua_tointeger(L, -1);
     lua_pop(L, 1);
+    if (kv_budget > 0) {
+      lua_getfield(L, 1, "spill_dir");
+      auto spill_dir = lua_tostring(L, -1);
+      inst->kv_offload_ = std::make_shared<cgemma::kv_offload>(kv_budget, spill_dir ? spill_dir : "");
+      lua_pop(L, 1);
+    }
     return 1;
   } catch (const std::exception& e) {
     lua_pop(L, 1);
@@ -2,9 +2,14 @@
 #define CGEMMA_INSTANCE_HPP
 
 #include "scheduler.hpp"
+#include "prefix_cache.hpp"
+#include "kv_pool.hpp"
+#include "kv_offload.hpp"
+#include "detokenizer.hpp"
+#include "token_filter.hpp"
 #include <gemma/gemma.h>
 #include <gemma/gemma_args.h>
-#include <unordered_set>
+#include <vector>
 #include <memory>
 
 namespace cgemma {
@@ -19,11 +24,22 @@ public:
   const gcpp::LoaderArgs& args() const { return args_; }
   gcpp::ThreadingContext& threading_ctx() const { return sched_->threading_ctx(); }
   gcpp::MatMulEnv& matmul_env() const { return sched_->matmul_env(); }
+  const scheduler* sched() const { return sched_; }
   gcpp::Gemma& model() const { return *model_; }
-  const std::unordered_set<int>& disabled_tokens() const { return disabled_tokens_; }
+  // Applied to every session, which may add its own on top.
+  const std::shared_ptr<const cgemma::token_filter>& filter() const { return filter_; }
+  const cgemma::piece_table& pieces() const { return *pieces_; }
+  cgemma::prefix_cache* prefix_cache() const { return prefix_cache_.get(); }
+  cgemma::kv_pool* kv_pool() const { return kv_pool_.get(); }
+  const std::shared_ptr<cgemma::kv_offload>& kv_offload() const { return kv_offload_; }
   size_t max_tokens() const { return model_->Config().max_seq_len; }
   bool instruction_tuned() const;
   bool eos(int token) const;
+  // Tokenizes `text` as is, without any wrapping.
+  std::vector<int> encode(const char* text, size_t len) const;
+  // Reads an array of token IDs of the vocabulary at `index`.
+  std::vector<int> read_tokens(lua_State* L, int index) const;
+  std::shared_ptr<gcpp::KVCache> new_kv_cache(const gcpp::InferenceArgs& args) const;
 
   static void declare(lua_State* L);
   static instance* check(lua_State* L, int index);
@@ -34,7 +50,12 @@ private:
   scheduler* sched_;
   std::unique_ptr<scheduler> default_sched_;
   std::unique_ptr<gcpp::Gemma> model_;
-  std::unordered_set<int> disabled_tokens_;
+  std::unique_ptr<cgemma::piece_table> pieces_;
+  std::shared_ptr<const cgemma::token_filter> filter_;
+  std::unique_ptr<cgemma::prefix_cache> prefix_cache_;
+  std::unique_ptr<cgemma::kv_pool> kv_pool_;
+  // Sessions may outlive the instance, so they refer to it weakly.
+  std::shared_ptr<cgemma::kv_offload> kv_offload_;
 };
 
 }
@@ -0,0 +1,57 @@
+#include "kv_offload.hpp"
+#include "session.hpp"
+#include <exception>
+
+namespace cgemma {
+
+kv_offload::kv_offload(size_t budget, std::filesystem::path spill_dir)
+  : budget_(budget)
+  , spill_dir_(std::move(spill_dir)) {
+  // nop
+}
+
+void kv_offload::touch(session* sess, size_t bytes) {
+  auto it = index_.find(sess);
+  if (it != index_.end()) {
+    lru_.splice(lru_.end(), lru_, it->second.first);
+    resident_bytes_ = resident_bytes_ - it->second.second + bytes;
+    it->second.second = bytes;
+  } else {
+    index_.emplace(sess, std::make_pair(lru_.insert(lru_.end(), sess), bytes));
+    resident_bytes_ += bytes;
+  }
+}
+
+void kv_offload::forget(const session* sess) {
+  auto it = index_.find(sess);
+  if (it != index_.end()) {
+    resident_bytes_ -= it->second.second;
+    lru_.erase(it->second.first);
+    index_.erase(it);
+  }
+}
+
+void kv_offload::trim(size_t keep) {
+  if (lru_.size() <= keep) {
+    return;
+  }
+  auto n = lru_.size() - keep;
+  for (auto it = lru_.begin(); resident_bytes_ > budget_ && n > 0; --n) {
+    auto victim = *it++;
+    // A task is writing to the KV cache of a busy session.
+    if (victim->busy()) {
+      continue;
+    }
+    // A victim that fails to spill stays resident, the next one is tried
+    // instead of failing the generation that needs the room.
+    try {
+      victim->spill(spill_dir_);
+    } catch (const std::exception&) {
+      continue;
+    }
+    forget(victim);
+    ++spills_;
+  }
+}
+
+}
@@ -0,0 +1,46 @@
+#ifndef CGEMMA_KV_OFFLOAD_HPP
+#define CGEMMA_KV_OFFLOAD_HPP
+
+#include <filesystem>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <cstddef>
+
+namespace cgemma {
+
+class session;
+
+// Keeps the KV caches of sessions resident within a memory budget, the least
+// recently used ones are spilled to `spill_dir`, or compressed in memory if
+// it is empty, and faulted back in on their next use.
+class kv_offload {
+public:
+  kv_offload(size_t budget, std::filesystem::path spill_dir);
+
+  size_t budget() const { return budget_; }
+  const std::filesystem::path& spill_dir() const { return spill_dir_; }
+  size_t resident_bytes() const { return resident_bytes_; }
+  size_t resident_sessions() const { return lru_.size(); }
+  size_t spills() const { return spills_; }
+
+  // Marks the KV cache of `sess` as the most recently used one.
+  void touch(session* sess, size_t bytes);
+  void forget(const session* sess);
+  // Spills the least recently used KV caches until the resident ones fit the
+  // budget, the `keep` most recently used ones and busy ones are never
+  // spilled.
+  void trim(size_t keep);
+
+private:
+  size_t budget_;
+  std::filesystem::path spill_dir_;
+  std::list<session*> lru_;
+  std::unordered_map<const session*, std::pair<std::list<session*>::iterator, size_t>> index_;
+  size_t resident_bytes_ {0};
+  size_t spills_ {0};
+};
+
+}
+
+#endif  // CGEMMA_KV_OFFLOAD_HPP
@@ -0,0 +1,73 @@
+#include "kv_pool.hpp"
+#include <cstring>
+
+namespace cgemma {
+
+kv_pool::kv_pool(const gcpp::ModelConfig& config, const gcpp::InferenceArgs& args, gcpp::ThreadingContext& ctx, size_t capacity)
+  : config_(config)
+  , args_(args)
+  , ctx_(ctx)
+  , state_(std::make_shared<state>()) {
+  state_->capacity = capacity;
+  state_->idle.reserve(capacity);
+  for (size_t i = 0; i < capacity; ++i) {
+    auto kv_cache = allocate();
+    // Touch every page now rather than on the first prefill.
+    auto& mat = kv_cache->kv_cache;
+    if (mat.Rows() > 0) {
+      std::memset(mat.RowBytes(0), 0, mat.Rows() * mat.Stride() * mat.ElementBytes());
+    }
+    state_->idle.push_back(std::move(kv_cache));
+  }
+}
+
+size_t kv_pool::size() const {
+  std::lock_guard<std::mutex> lock(state_->mtx);
+  return state_->idle.size();
+}
+
+size_t kv_pool::hits() const {
+  std::lock_guard<std::mutex> lock(state_->mtx);
+  return state_->hits;
+}
+
+size_t kv_pool::misses() const {
+  std::lock_guard<std::mutex> lock(state_->mtx);
+  return state_->misses;
+}
+
+std::shared_ptr<gcpp::KVCache> kv_pool::acquire(const gcpp::InferenceArgs& args) {
+  if (args.seq_len != args_.seq_len) {
+    return std::make_shared<gcpp::KVCache>(config_, args, ctx_.allocator);
+  }
+  std::unique_ptr<gcpp::KVCache> kv_cache;
+  {
+    std::lock_guard<std::mutex> lock(state_->mtx);
+    if (state_->idle.empty()) {
+      ++state_->misses;
+    } else {
+      ++state_->hits;
+      kv_cache = std::move(state_->idle.back());
+      state_->idle.pop_back();
+    }
+  }
+  if (!kv_cache) {
+    kv_cache = allocate();
+  }
+  std::weak_ptr<state> weak_state = state_;
+  return std::shared_ptr<gcpp::KVCache>(kv_cache.release(), [weak_state](gcpp::KVCache* p) {
+    std::unique_ptr<gcpp::KVCache> kv_cache(p);
+    if (auto s = weak_state.lock()) {
+      std::lock_guard<std::mutex> lock(s->mtx);
+      if (s->idle.size() < s->capacity) {
+        s->idle.push_back(std::move(kv_cache));
+      }
+    }
+  });
+}
+
+std::unique_ptr<gcpp::KVCache> kv_pool::allocate() const {
+  return std::make_unique<gcpp::KVCache>(config_, args_, ctx_.allocator);
+}
+
+}
@@ -0,0 +1,50 @@
+#ifndef CGEMMA_KV_POOL_HPP
+#define CGEMMA_KV_POOL_HPP
+
+#include <gemma/gemma.h>
+#include <gemma/gemma_args.h>
+#include <util/threading_context.h>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+namespace cgemma {
+
+class kv_pool {
+public:
+  // Preallocates `capacity` KV caches for sessions whose sequence length is
+  // the same as `args`.
+  kv_pool(const gcpp::ModelConfig& config, const gcpp::InferenceArgs& args, gcpp::ThreadingContext& ctx, size_t capacity);
+
+  size_t capacity() const { return state_->capacity; }
+  size_t seq_len() const { return args_.seq_len; }
+  size_t size() const;
+  size_t hits() const;
+  size_t misses() const;
+
+  // Checks a KV cache out of the pool, it goes back to the pool when the
+  // last reference is released. KV caches of other sequence lengths are
+  // allocated as usual.
+  std::shared_ptr<gcpp::KVCache> acquire(const gcpp::InferenceArgs& args);
+
+private:
+  struct state {
+    std::mutex mtx;
+    size_t capacity;
+    std::vector<std::unique_ptr<gcpp::KVCache>> idle;
+    size_t hits {0};
+    size_t misses {0};
+  };
+
+  std::unique_ptr<gcpp::KVCache> allocate() const;
+
+  const gcpp::ModelConfig& config_;
+  gcpp::InferenceArgs args_;
+  gcpp::ThreadingContext& ctx_;
+  // KV caches may outlive the pool, they are freed if it is already gone.
+  std::shared_ptr<state> state_;
+};
+
+}
+
+#endif  // CGEMMA_KV_POOL_HPP
@@ -0,0 +1,112 @@
+#include "prefix_cache.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace cgemma {
+
+prefix_cache::prefix_cache(size_t capacity)
+  : capacity_(capacity) {
+  // nop
+}
+
+size_t prefix_cache::restore(const std::vector<int>& tokens, size_t max_len, gcpp::KVCache& kv_cache) {
+  auto& mat = kv_cache.kv_cache;
+  auto row_bytes = mat.Stride() * mat.ElementBytes();
+  if (row_bytes == 0) {
+    return 0;
+  }
+  max_len = std::min({max_len, tokens.size(), mat.Rows()});
+  size_t matched = 0;
+  for (auto n = &root_; matched < max_len;) {
+    auto it = n->children.find(tokens[matched]);
+    if (it == n->children.end()) {
+      break;
+    }
+    auto child = it->second.get();
+    size_t k = 1;
+    while (k < child->tokens.size() && matched + k < max_len && child->tokens[k] == tokens[matched + k]) {
+      ++k;
+    }
+    std::memcpy(mat.RowBytes(matched), child->rows.data(), k * row_bytes);
+    child->last_used = ++clock_;
+    matched += k;
+    if (k < child->tokens.size()) {
+      break;
+    }
+    n = child;
+  }
+  return matched;
+}
+
+void prefix_cache::insert(const std::vector<int>& tokens, size_t len, const gcpp::KVCache& kv_cache) {
+  auto& mat = kv_cache.kv_cache;
+  auto row_bytes = mat.Stride() * mat.ElementBytes();
+  len = std::min({len, tokens.size(), mat.Rows()});
+  if (row_bytes == 0 || len * row_bytes > capacity_) {
+    return;
+  }
+  auto now = ++clock_;
+  size_t matched = 0;
+  for (auto n = &root_; matched < len;) {
+    auto it = n->children.find(tokens[matched]);
+    if (it == n->children.end()) {
+      auto leaf = std::make_unique<node>();
+      leaf->parent = n;
+      leaf->tokens.assign(tokens.begin() + matched, tokens.begin() + len);
+      auto rows = reinterpret_cast<const char*>(mat.RowBytes(matched));
+      leaf->rows.assign(rows, rows + (len - matched) * row_bytes);
+      leaf->last_used = now;
+      size_ += leaf->rows.size();
+      n->children.emplace(tokens[matched], std::move(leaf));
+      break;
+    }
+    auto child = it->second.get();
+    size_t k = 1;
+    while (k < child->tokens.size() && matched + k < len && child->tokens[k] == tokens[matched + k]) {
+      ++k;
+    }
+    if (k < child->tokens.size()) {
+      // Split the edge, the common part becomes a new inner node.
+      auto inner = std::make_unique<node>();
+      inner->parent = n;
+      inner->tokens.assign(child->tokens.begin(), child->tokens.begin() + k);
+      inner->rows.assign(child->rows.begin(), child->rows.begin() + k * row_bytes);
+      child->tokens.erase(child->tokens.begin(), child->tokens.begin() + k);
+      child->rows = std::vector<char>(child->rows.begin() + k * row_bytes, child->rows.end());
+      child->parent = inner.get();
+      auto key = child->tokens.front();
+      inner->children.emplace(key, std::move(it->second));
+      it->second = std::move(inner);
+      child = it->second.get();
+    }
+    child->last_used = now;
+    matched += k;
+    n = child;
+  }
+  evict();
+}
+
+void prefix_cache::evict() {
+  while (size_ > capacity_) {
+    node* lru = nullptr;
+    std::vector<node*> nodes {&root_};
+    while (!nodes.empty()) {
+      auto n = nodes.back();
+      nodes.pop_back();
+      if (!n->children.empty()) {
+        for (const auto& kv: n->children) {
+          nodes.push_back(kv.second.get());
+        }
+      } else if (n != &root_ && (!lru || n->last_used < lru->last_used)) {
+        lru = n;
+      }
+    }
+    if (!lru) {
+      break;
+    }
+    size_ -= lru->rows.size();
+    lru->parent->children.erase(lru->tokens.front());
+  }
+}
+
+}
@@ -0,0 +1,44 @@
+#ifndef CGEMMA_PREFIX_CACHE_HPP
+#define CGEMMA_PREFIX_CACHE_HPP
+
+#include <gemma/gemma.h>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cstdint>
+
+namespace cgemma {
+
+class prefix_cache {
+public:
+  explicit prefix_cache(size_t capacity);
+
+  size_t capacity() const { return capacity_; }
+  size_t size() const { return size_; }
+
+  // Copies the KV cache rows of the longest cached prefix of `tokens` (at
+  // most `max_len` tokens) into `kv_cache`, returns the length of the prefix.
+  size_t restore(const std::vector<int>& tokens, size_t max_len, gcpp::KVCache& kv_cache);
+  // Caches the KV cache rows of the first `len` tokens of `tokens`.
+  void insert(const std::vector<int>& tokens, size_t len, const gcpp::KVCache& kv_cache);
+
+private:
+  struct node {
+    node* parent {nullptr};
+    std::vector<int> tokens;
+    std::vector<char> rows;
+    std::map<int, std::unique_ptr<node>> children;
+    uint64_t last_used {0};
+  };
+
+  void evict();
+
+  size_t capacity_;
+  size_t size_ {0};
+  uint64_t clock_ {0};
+  node root_;
+};
+
+}
+
+#endif  // CGEMMA_PREFIX_CACHE_HPP
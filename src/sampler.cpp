@@ -0,0 +1,78 @@
+#include "sampler.hpp"
+#include <algorithm>
+#include <vector>
+#include <limits>
+#include <cmath>
+
+namespace cgemma {
+
+gcpp::TokenAndProb sample(gcpp::Logits logits, float temperature, size_t top_k, const token_filter& filter, std::mt19937& gen) {
+  filter.apply(logits);
+  auto n = static_cast<int>(logits.size());
+  auto max_logit = -std::numeric_limits<float>::infinity();
+  for (int i = 0; i < n; ++i) {
+    max_logit = std::max(max_logit, logits[i]);
+  }
+  auto sum = 0.0f;
+  for (int i = 0; i < n; ++i) {
+    sum += std::exp(logits[i] - max_logit);
+  }
+  int token = -1;
+  if (top_k <= 1 || temperature <= 0.0f) {
+    for (int i = 0; i < n; ++i) {
+      if (filter.enabled(i) && (token < 0 || logits[i] > logits[token])) {
+        token = i;
+      }
+    }
+  } else {
+    // Called from worker threads of the batch, so each keeps its buffers.
+    thread_local std::vector<int> candidates;
+    thread_local std::vector<float> weights;
+    candidates.clear();
+    for (int i = 0; i < n; ++i) {
+      if (filter.enabled(i)) {
+        candidates.push_back(i);
+      }
+    }
+    if (candidates.size() > top_k) {
+      std::nth_element(candidates.begin(), candidates.begin() + top_k - 1, candidates.end(), [&](int lhs, int rhs) {
+        return logits[lhs] > logits[rhs];
+      });
+      candidates.resize(top_k);
+    }
+    if (!candidates.empty()) {
+      auto top = *std::max_element(candidates.begin(), candidates.end(), [&](int lhs, int rhs) {
+        return logits[lhs] < logits[rhs];
+      });
+      weights.clear();
+      for (auto i: candidates) {
+        weights.push_back(std::exp((logits[i] - logits[top]) / temperature));
+      }
+      std::discrete_distribution<size_t> dist(weights.begin(), weights.end());
+      token = candidates[dist(gen)];
+    }
+  }
+  if (token < 0) {
+    // Every token is disabled.
+    token = 0;
+  }
+  return {token, std::exp(logits[token] - max_logit) / sum};
+}
+
+float log_prob(gcpp::Logits logits, int token) {
+  auto n = logits.size();
+  auto max_logit = -std::numeric_limits<float>::infinity();
+  for (size_t i = 0; i < n; ++i) {
+    max_logit = std::max(max_logit, logits[i]);
+  }
+  auto sum = 0.0f;
+  for (size_t i = 0; i < n; ++i) {
+    sum += std::exp(logits[i] - max_logit);
+  }
+  if (token < 0 || static_cast<size_t>(token) >= n) {
+    return -std::numeric_limits<float>::infinity();
+  }
+  return logits[token] - max_logit - std::log(sum);
+}
+
+}
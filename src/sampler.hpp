@@ -0,0 +1,20 @@
+#ifndef CGEMMA_SAMPLER_HPP
+#define CGEMMA_SAMPLER_HPP
+
+#include "token_filter.hpp"
+#include <gemma/gemma.h>
+#include <gemma/gemma_args.h>
+#include <random>
+
+namespace cgemma {
+
+// Samples a token from the top-K of `logits` at `temperature` once `filter`
+// is applied to them, tokens it disables are never sampled. The probability
+// returned is that of the softmax of the filtered logits.
+gcpp::TokenAndProb sample(gcpp::Logits logits, float temperature, size_t top_k, const token_filter& filter, std::mt19937& gen);
+// Returns the log of the probability of `token` in the softmax of `logits`.
+float log_prob(gcpp::Logits logits, int token);
+
+}
+
+#endif  // CGEMMA_SAMPLER_HPP
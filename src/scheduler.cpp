@@ -1,6 +1,7 @@
 #include "scheduler.hpp"
 #include "utils/laux.hpp"
 #include <util/threading_context.h>
+#include <stdexcept>
 
 namespace {
 
@@ -21,6 +22,20 @@ int destroy(lua_State* L) {
 
 namespace cgemma {
 
+scheduler::generation_lock::generation_lock(const scheduler* sched)
+  : sched_(sched) {
+  if (sched_->owner_ == std::this_thread::get_id()) {
+    throw std::runtime_error("Generation cannot be started from a stream function.");
+  }
+  sched_->mtx_.lock();
+  sched_->owner_ = std::this_thread::get_id();
+}
+
+scheduler::generation_lock::~generation_lock() {
+  sched_->owner_ = std::thread::id();
+  sched_->mtx_.unlock();
+}
+
 void scheduler::declare(lua_State* L) {
   constexpr const luaL_Reg metatable[] = {
     {"__gc", destroy},
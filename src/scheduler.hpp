@@ -5,11 +5,29 @@
 #include <util/threading_context.h>
 #include <ops/matmul.h>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <thread>
 
 namespace cgemma {
 
 class scheduler {
 public:
+  // Held while generating, the threads of a scheduler serve one generation
+  // at a time. A generation started on the thread already holding it, i.e.
+  // from a stream function, throws instead of waiting for itself.
+  class generation_lock {
+  public:
+    explicit generation_lock(const scheduler* sched);
+    generation_lock(const generation_lock&) = delete;
+    ~generation_lock();
+
+    generation_lock& operator=(const generation_lock&) = delete;
+
+  private:
+    const scheduler* sched_;
+  };
+
   scheduler() { init(); }
   scheduler(int argc, char* argv[]) : args_(argc, argv) { init(); }
 
@@ -31,6 +49,8 @@ private:
   gcpp::ThreadingArgs args_;
   std::unique_ptr<gcpp::ThreadingContext> ctx_;
   std::unique_ptr<gcpp::MatMulEnv> env_;
+  mutable std::mutex mtx_;
+  mutable std::atomic<std::thread::id> owner_ {};
 };
 
 }
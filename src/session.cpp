@@ -1,26 +1,64 @@
 #include "session.hpp"
 #include "instance.hpp"
 #include "image_tokens.hpp"
+#include "snapshot.hpp"
+#include "task.hpp"
+#include "batch.hpp"
+#include "stream_buffer.hpp"
+#include "context_shift.hpp"
+#include "kv_offload.hpp"
+#include "speculative.hpp"
+#include "grammar.hpp"
+#include "sampler.hpp"
 #include "utils/file_io.hpp"
+#include "utils/laux.hpp"
 #include <stdexcept>
+#include <cstring>
 #include <algorithm>
-#include <numeric>
-#include <array>
+#include <iterator>
+#include <string>
+#include <unistd.h>
 
 namespace {
 
 constexpr const char name[] = "cgemma.session";
 
-void generate(cgemma::session* sess, const gcpp::ImageTokens* image, const std::vector<int>& prompt, const gcpp::BatchStreamFunc& stream_token) {
+void generate(cgemma::session* sess, const gcpp::ImageTokens* image, const std::vector<int>& prompt, const gcpp::BatchStreamFunc& stream_token, bool prefill_only = false) {
+  if (auto spec = sess->spec()) {
+    if (image) {
+      spec->invalidate();
+    } else if (!prefill_only && spec->generate(sess, prompt, stream_token)) {
+      return;
+    }
+  }
   gcpp::RuntimeConfig cfg;
   sess->args().CopyTo(cfg);
   cfg.verbosity = 0;
+  if (prefill_only) {
+    cfg.max_generated_tokens = 0;
+  }
+  cfg.gen = &sess->rng();
   cfg.batch_stream_token = stream_token;
-  if (!sess->inst()->disabled_tokens().empty()) {
-    cfg.accept_token = [&](int token, float) {
-      return sess->inst()->disabled_tokens().find(token) == sess->inst()->disabled_tokens().end();
+  // Every call is an output of its own, so matching starts over.
+  auto g = sess->constraint().get();
+  auto g_state = g ? g->initial() : 0;
+  if (g || !sess->filter().empty()) {
+    cfg.sample_func = [&](size_t, size_t, gcpp::Logits logits, size_t) {
+      if (g) {
+        g->mask(g_state, logits);
+      }
+      auto tp = cgemma::sample(logits, sess->args().temperature, sess->args().top_k, sess->filter(), sess->rng());
+      if (g) {
+        g_state = g->advance(g_state, tp.token);
+      }
+      return tp;
     };
   }
+  auto& kv_cache = sess->mutable_kv_cache();
+  if (sess->inst()->kv_offload()) {
+    sess->inst()->kv_offload()->trim(1);
+  }
+  cgemma::scheduler::generation_lock lock(sess->inst()->sched());
   if (image) {
     size_t prefix_end = 0;
     if (sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
@@ -28,9 +66,14 @@ void generate(cgemma::session* sess, const gcpp::ImageTokens* image, const std::
       prefix_end = prompt.size();
     }
     cfg.image_tokens = image;
-    sess->inst()->model().Generate(cfg, gcpp::PromptTokens(prompt.data(), prompt.size()), sess->pos(), prefix_end, sess->kv_cache(), sess->inst()->matmul_env(), sess->timing_info());
+    sess->inst()->model().Generate(cfg, gcpp::PromptTokens(prompt.data(), prompt.size()), sess->pos(), prefix_end, kv_cache, sess->inst()->matmul_env(), sess->timing_info());
   } else {
-    sess->inst()->model().Generate(cfg, gcpp::PromptTokens(prompt.data(), prompt.size()), sess->pos(), sess->kv_cache(), sess->inst()->matmul_env(), sess->timing_info());
+    auto start_pos = sess->pos();
+    auto cached = sess->restore_prefix(prompt);
+    sess->inst()->model().Generate(cfg, gcpp::PromptTokens(prompt.data() + cached, prompt.size() - cached), sess->pos(), kv_cache, sess->inst()->matmul_env(), sess->timing_info());
+    if (start_pos == 0) {
+      sess->cache_prefix(prompt);
+    }
   }
 }
 
@@ -40,35 +83,81 @@ int stream_mode(lua_State* L, cgemma::session* sess, const gcpp::ImageTokens* im
   }
   auto start_pos = sess->pos();
   auto prompt_size = prompt.size();
-  std::vector<int> output(1);
-  generate(sess, image, prompt, [&](size_t, size_t pos, int token, float) {
-    auto eot = false;
+  cgemma::stream_buffer buf(sess->inst(), sess->stream_opts());
+  // Errors of the stream function are raised once the generation is left.
+  std::string err;
+  auto call_stream_fn = [&](const std::string* text, size_t pos) {
+    if (!err.empty()) {
+      return false;
+    }
     lua_pushvalue(L, stream_fn);
-    if (pos - start_pos < prompt_size) {
-      lua_pushnil(L);
-    } else if (sess->inst()->eos(token)) {
-      eot = true;
-      lua_pushnil(L);
+    if (text) {
+      lua_pushlstring(L, text->data(), text->size());
     } else {
-      output.front() = token;
-      std::string token_text;
-      if (!sess->inst()->model().Tokenizer().Decode(output, &token_text)) {
-        throw std::runtime_error("Tokenizer decoding failed. (stream_mode)");
-      }
-      lua_pushlstring(L, token_text.data(), token_text.size());
+      lua_pushnil(L);
     }
     lua_pushinteger(L, pos - start_pos);
     lua_pushinteger(L, prompt_size);
-    lua_call(L, 3, 1);
-    auto res = lua_toboolean(L, -1);
+    if (!cgemma::utils::pcall(L, 3, 1, err)) {
+      return false;
+    }
+    auto res = lua_toboolean(L, -1) ? true : false;
     lua_pop(L, 1);
-    if (!eot && res) {
-      sess->set_pos(pos);
-      return true;
-    } else {
+    return res;
+  };
+  size_t last_pos = start_pos;
+  // Set once the stream has ended or the stream function stopped it, nothing
+  // is delivered after that.
+  auto done = false;
+  cgemma::stop_matcher stop(sess->inst(), sess->stop_opts());
+  generate(sess, image, prompt, [&](size_t, size_t pos, int token, float) {
+    if (pos - start_pos < prompt_size) {
+      if (buf.prefill() && !call_stream_fn(nullptr, pos)) {
+        done = true;
+        return false;
+      }
+    } else if (sess->inst()->eos(token)) {
+      buf.finish();
+      if (!buf.text().empty()) {
+        call_stream_fn(&buf.text(), last_pos);
+      }
+      buf.flush();
+      call_stream_fn(nullptr, pos);
+      done = true;
       return false;
+    } else {
+      auto stopped = stop.push(token);
+      if (buf.push(token) || stopped) {
+        if (stopped) {
+          buf.finish();
+        }
+        auto more = buf.text().empty() || call_stream_fn(&buf.text(), pos);
+        buf.flush();
+        if (!more) {
+          done = true;
+          return false;
+        }
+      }
+      last_pos = pos;
+      if (stopped) {
+        sess->set_pos(pos);
+        call_stream_fn(nullptr, pos);
+        done = true;
+        return false;
+      }
     }
+    sess->set_pos(pos);
+    return true;
   });
+  if (!done) {
+    buf.finish();
+    if (!buf.text().empty()) {
+      call_stream_fn(&buf.text(), last_pos);
+    }
+  }
+  if (!err.empty()) {
+    throw std::runtime_error(err);
+  }
   lua_pushboolean(L, 1);
   return 1;
 }
@@ -81,37 +170,42 @@ int normal_mode(lua_State* L, cgemma::session* sess, const gcpp::ImageTokens* im
   auto prompt_size = prompt.size();
   std::vector<int> output;
   output.reserve(sess->args().max_generated_tokens);
+  cgemma::stop_matcher stop(sess->inst(), sess->stop_opts());
   generate(sess, image, prompt, [&](size_t, size_t pos, int token, float) {
     if (pos - start_pos >= prompt_size) {
       if (sess->inst()->eos(token)) {
         return false;
       }
       output.push_back(token);
+      sess->set_pos(pos);
+      return !stop.push(token);
     }
     sess->set_pos(pos);
     return true;
   });
-  std::string resp;
-  if (!sess->inst()->model().Tokenizer().Decode(output, &resp)) {
-    throw std::runtime_error("Tokenizer decoding failed. (normal_mode)");
-  }
-  lua_pushlstring(L, resp.data(), resp.size());
+  cgemma::push_output(L, sess, output);
   return 1;
 }
 
 int call(lua_State* L) {
   auto sess = cgemma::session::check(L, 1);
-  if (sess->pos() >= sess->inst()->max_tokens()) {
+  if (sess->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  if (!sess->context_shift() && sess->pos() >= sess->inst()->max_tokens()) {
     lua_pushnil(L);
     lua_pushliteral(L, "Session has ended.");
     return 2;
   }
   try {
-    size_t len;
     auto image = cgemma::image_tokens::to(L, 2);
     auto offset = image ? 2 : 1;
-    auto text = luaL_checklstring(L, 1 + offset, &len);
-    auto prompt = image ? sess->tokenize(*image, text, len) : sess->tokenize(text, len);
+    auto prompt = sess->read_prompt(L, 1 + offset, image);
+    if (sess->inst()->model().Config().wrapping != gcpp::PromptWrapping::PALIGEMMA) {
+      sess->make_room(prompt.size() + sess->args().max_generated_tokens);
+    }
     return lua_isfunction(L, 2 + offset) ? stream_mode(L, sess, image, prompt, 2 + offset) : normal_mode(L, sess, image, prompt);
   } catch (const std::exception& e) {
     lua_pushnil(L);
@@ -120,6 +214,64 @@ int call(lua_State* L) {
   }
 }
 
+int prefill(lua_State* L) {
+  auto sess = cgemma::session::check(L, 1);
+  if (sess->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  if (!sess->context_shift() && sess->pos() >= sess->inst()->max_tokens()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session has ended.");
+    return 2;
+  }
+  try {
+    auto image = cgemma::image_tokens::to(L, 2);
+    auto prompt = sess->read_prompt(L, image ? 3 : 2, image);
+    if (sess->inst()->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+      sess->set_pos(0);
+    } else {
+      sess->make_room(prompt.size());
+    }
+    auto start_pos = sess->pos();
+    generate(sess, image, prompt, [&](size_t, size_t pos, int, float) {
+      if (pos - start_pos >= prompt.size()) {
+        return false;
+      }
+      sess->set_pos(pos);
+      return true;
+    }, true);
+    if (sess->spec() && !image) {
+      sess->spec()->append(sess, start_pos, prompt);
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int score(lua_State* L) {
+  auto sess = cgemma::session::check(L, 1);
+  if (sess->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  if (lua_gettop(L) > (cgemma::image_tokens::to(L, 2) ? 4 : 3)) {
+    luaL_error(L, "Too many arguments");
+  }
+  auto n = cgemma::score(L);
+  if (n != 1) {
+    return n;
+  }
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
 int destroy(lua_State* L) {
   cgemma::session::check(L, 1)->~session();
   return 0;
@@ -127,112 +279,113 @@ int destroy(lua_State* L) {
 
 int ready(lua_State* L) {
   auto sess = cgemma::session::check(L, 1);
-  lua_pushboolean(L, sess->pos() < sess->inst()->max_tokens() ? 1 : 0);
+  lua_pushboolean(L, sess->context_shift() || sess->pos() < sess->inst()->max_tokens() ? 1 : 0);
   return 1;
 }
 
 int reset(lua_State* L) {
-  cgemma::session::check(L, 1)->set_pos(0);
-  return 0;
+  auto sess = cgemma::session::check(L, 1);
+  if (sess->busy()) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  sess->reset();
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
-enum class kv_cache_field: size_t {
-  kv_cache,
-  end
-};
-
-template <class T>
-class kv_cache_blob {
-public:
-  template <class U>
-  kv_cache_blob(U sess, size_t resumed_pos = 0) {
-    if (sess->inst()->model().Config().KVCacheCols() > 0) {
-      auto& kv_cache = sess->kv_cache().kv_cache;
-      auto pos = std::min(resumed_pos ? resumed_pos : sess->pos(), kv_cache.Rows());
-      ptrs_[static_cast<size_t>(kv_cache_field::kv_cache)] = kv_cache.RowBytes(0);
-      sizes_[static_cast<size_t>(kv_cache_field::kv_cache)] = pos * kv_cache.Stride() * kv_cache.ElementBytes();
-    } else {
-      ptrs_[static_cast<size_t>(kv_cache_field::kv_cache)] = nullptr;
-      sizes_[static_cast<size_t>(kv_cache_field::kv_cache)] = 0;
-    }
+int fork(lua_State* L) {
+  auto parent = cgemma::session::check(L, 1);
+  if (parent->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
   }
-
-  template <kv_cache_field Field>
-  T buffer() const { return ptrs_[static_cast<size_t>(Field)]; }
-
-  template <kv_cache_field Field>
-  size_t size() const { return sizes_[static_cast<size_t>(Field)]; }
-
-  size_t total_size() const {
-    return std::accumulate(sizes_.begin() + 1, sizes_.end(), sizes_.front());
+  try {
+    cgemma::session::push_fork(L, parent);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
   }
+}
 
-private:
-  std::array<T, static_cast<size_t>(kv_cache_field::end)> ptrs_;
-  std::array<size_t, static_cast<size_t>(kv_cache_field::end)> sizes_;
-};
-
-size_t dump_impl(char* buf, const cgemma::session* sess) {
-  auto type = sess->inst()->model().Config().model;
-  uint16_t pos = sess->pos();
-  kv_cache_blob<const void*> blob(sess);
-  if (buf) {
-    std::memcpy(buf, name, sizeof(name) - 1);
-    buf[sizeof(name) - 1] = static_cast<char>(type);
-    buf += sizeof(name);
-    std::memcpy(buf, &pos, sizeof(pos));
-    buf += sizeof(pos);
-#define DUMP_CACHE(FIELD)                                                                         \
-  do {                                                                                            \
-    if (blob.buffer<kv_cache_field::FIELD>()) {                                                   \
-      std::memcpy(buf, blob.buffer<kv_cache_field::FIELD>(), blob.size<kv_cache_field::FIELD>()); \
-      buf += blob.size<kv_cache_field::FIELD>();                                                  \
-    }                                                                                             \
-  } while (false)
-    DUMP_CACHE(kv_cache);
-#undef DUMP_CACHE
+// Feeds the tokens stored in a dump to the speculator, which cannot follow a
+// dump without them.
+void follow_load(cgemma::session* sess, const cgemma::snapshot::token_history& history) {
+  if (auto spec = sess->spec()) {
+    if (history.present) {
+      spec->append(sess, history.first_pos, history.tokens);
+    } else {
+      spec->invalidate();
+    }
   }
-  return sizeof(name) + sizeof(pos) + blob.total_size();
 }
 
-void load_impl(cgemma::session* sess, const char* buf, size_t n) {
-  if (n < sizeof(name) + sizeof(uint16_t)) {
-    throw std::invalid_argument("Invalid dump format: length too short");
-  }
-  for (size_t i = 0; i < sizeof(name) - 1; ++i) {
-    if (buf[i] != name[i]) {
-      throw std::invalid_argument("Invalid dump format: magic mismatch");
+cgemma::snapshot::options dump_options(lua_State* L, int index) {
+  cgemma::snapshot::options opts;
+  if (lua_gettop(L) >= index) {
+    luaL_checktype(L, index, LUA_TTABLE);
+    lua_getfield(L, index, "checksum");
+    opts.checksum = lua_toboolean(L, -1) ? true : false;
+    lua_pop(L, 1);
+    lua_getfield(L, index, "encoding");
+    if (!lua_isnil(L, -1)) {
+      constexpr const char* encodings[] = {"raw", "bf16", "int8", "deflate"};
+      auto enc = lua_tostring(L, -1);
+      auto it = enc ? std::find_if(std::begin(encodings), std::end(encodings), [&](const char* e) { return std::strcmp(e, enc) == 0; }) : std::end(encodings);
+      if (it == std::end(encodings)) {
+        luaL_argerror(L, index, "invalid encoding");
+      }
+      opts.kv_encoding = static_cast<cgemma::snapshot::encoding>(it - std::begin(encodings));
     }
+    lua_pop(L, 1);
   }
-  auto type = static_cast<gcpp::Model>(buf[sizeof(name) - 1]);
-  if (type != sess->inst()->model().Config().model) {
-    throw std::invalid_argument("Invalid dump format: model type mismatch");
-  }
-  buf += sizeof(name);
-  size_t pos = *reinterpret_cast<const uint16_t*>(buf);
-  buf += sizeof(uint16_t);
-  kv_cache_blob<void*> blob(sess, pos);
-  if (n != sizeof(name) + sizeof(uint16_t) + blob.total_size()) {
-    throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
-  }
-  sess->set_pos(pos);
-#define LOAD_CACHE(FIELD)                                                                         \
-  do {                                                                                            \
-    if (blob.buffer<kv_cache_field::FIELD>()) {                                                   \
-      std::memcpy(blob.buffer<kv_cache_field::FIELD>(), buf, blob.size<kv_cache_field::FIELD>()); \
-      buf += blob.size<kv_cache_field::FIELD>();                                                  \
-    }                                                                                             \
-  } while (false)
-  LOAD_CACHE(kv_cache);
-#undef LOAD_CACHE
+  return opts;
 }
 
 int dumps(lua_State* L) {
   auto ud = cgemma::session::check(L, 1);
+  if (ud->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  auto streaming = lua_isfunction(L, 2);
+  auto opts = dump_options(L, streaming ? 3 : 2);
+  size_t chunk_size = 65536;
+  if (streaming && lua_gettop(L) >= 3) {
+    lua_getfield(L, 3, "chunk_size");
+    if (!lua_isnil(L, -1)) {
+      auto n = lua_tointeger(L, -1);
+      if (n <= 0) {
+        luaL_argerror(L, 3, "chunk_size must be positive");
+      }
+      chunk_size = n;
+    }
+    lua_pop(L, 1);
+  }
   try {
-    std::vector<char> buf(dump_impl(nullptr, ud));
-    dump_impl(buf.data(), ud);
-    lua_pushlstring(L, buf.data(), buf.size());
+    cgemma::snapshot::dumper dumper(ud, opts);
+    if (streaming) {
+      dumper.write(chunk_size, [&](const char* data, size_t n) {
+        lua_pushvalue(L, 2);
+        lua_pushlstring(L, data, n);
+        lua_call(L, 1, 1);
+        auto res = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+        if (!res) {
+          throw std::runtime_error("Dumping terminated by the sink");
+        }
+      });
+      lua_pushboolean(L, 1);
+    } else {
+      std::vector<char> buf(dumper.size());
+      dumper.write(buf.data());
+      lua_pushlstring(L, buf.data(), buf.size());
+    }
     return 1;
   } catch (const std::exception& e) {
     lua_pushnil(L);
@@ -243,25 +396,110 @@ int dumps(lua_State* L) {
 
 int loads(lua_State* L) {
   auto ud = cgemma::session::check(L, 1);
-  size_t n;
-  auto buf = luaL_checklstring(L, 2, &n);
+  if (ud->busy()) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  auto top = lua_gettop(L);
+  for (auto i = 2; i <= std::max(top, 2); ++i) {
+    if (!lua_isfunction(L, i)) {
+      luaL_checkstring(L, i);
+    }
+  }
   try {
-    load_impl(ud, buf, n);
+    for (auto i = 2; i <= top; ++i) {
+      if (lua_isfunction(L, i)) {
+        cgemma::snapshot::loader loader(ud);
+        for (;;) {
+          lua_pushvalue(L, i);
+          lua_call(L, 0, 1);
+          if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            break;
+          }
+          size_t n;
+          auto chunk = lua_tolstring(L, -1, &n);
+          if (!chunk) {
+            lua_pop(L, 1);
+            throw std::invalid_argument("Chunk must be a string");
+          }
+          loader.update(chunk, n);
+          lua_pop(L, 1);
+        }
+        follow_load(ud, loader.finish());
+      } else {
+        size_t n;
+        auto buf = lua_tolstring(L, i, &n);
+        follow_load(ud, cgemma::snapshot::load(ud, buf, n));
+      }
+    }
     lua_pushboolean(L, 1);
     return 1;
   } catch (const std::exception& e) {
+    if (ud->spec()) {
+      ud->spec()->invalidate();
+    }
     lua_pushboolean(L, 0);
     lua_pushstring(L, e.what());
     return 2;
   }
 }
 
+void check_path_or_fd(lua_State* L, int index) {
+  if (lua_type(L, index) != LUA_TNUMBER) {
+    luaL_checkstring(L, index);
+  }
+}
+
+void dump_to(lua_State* L, int index, const cgemma::session* sess, const cgemma::snapshot::options& opts) {
+  cgemma::snapshot::dumper dumper(sess, opts);
+  if (lua_type(L, index) == LUA_TNUMBER) {
+    std::vector<char> buf(dumper.size());
+    dumper.write(buf.data());
+    cgemma::utils::write_fd(lua_tointeger(L, index), buf.data(), buf.size());
+  } else {
+    cgemma::utils::file_writer fout(lua_tostring(L, index), dumper.size());
+    dumper.write(fout.buffer());
+  }
+}
+
 int dump(lua_State* L) {
   auto ud = cgemma::session::check(L, 1);
-  auto path = luaL_checkstring(L, 2);
+  if (ud->busy()) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  check_path_or_fd(L, 2);
+  auto opts = dump_options(L, 3);
   try {
-    cgemma::utils::file_writer fout(path, dump_impl(nullptr, ud));
-    dump_impl(fout.buffer(), ud);
+    dump_to(L, 2, ud, opts);
+    lua_pushboolean(L, 1);
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushboolean(L, 0);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int dump_delta(lua_State* L) {
+  auto ud = cgemma::session::check(L, 1);
+  if (ud->busy()) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  check_path_or_fd(L, 2);
+  auto since = luaL_checkinteger(L, 3);
+  if (since < 0) {
+    luaL_argerror(L, 3, "since_pos must not be negative");
+  }
+  auto opts = dump_options(L, 4);
+  opts.since = since;
+  try {
+    dump_to(L, 2, ud, opts);
     lua_pushboolean(L, 1);
     return 1;
   } catch (const std::exception& e) {
@@ -273,13 +511,40 @@ int dump(lua_State* L) {
 
 int load(lua_State* L) {
   auto ud = cgemma::session::check(L, 1);
-  auto path = luaL_checkstring(L, 2);
+  if (ud->busy()) {
+    lua_pushboolean(L, 0);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  auto top = lua_gettop(L);
+  auto lazy = false;
+  if (top >= 3 && lua_istable(L, top)) {
+    lua_getfield(L, top, "lazy");
+    lazy = lua_toboolean(L, -1) ? true : false;
+    lua_pop(L, 1);
+    --top;
+  }
+  luaL_checkstring(L, 2);
+  for (auto i = 3; i <= top; ++i) {
+    luaL_checkstring(L, i);
+  }
   try {
-    cgemma::utils::file_reader fin(path);
-    load_impl(ud, fin.buffer(), fin.size());
+    for (auto i = 2; i <= top; ++i) {
+      auto path = lua_tostring(L, i);
+      if (lazy) {
+        auto fin = std::make_shared<cgemma::utils::file_reader>(path, false);
+        follow_load(ud, cgemma::snapshot::load(ud, fin->buffer(), fin->size(), fin));
+      } else {
+        cgemma::utils::file_reader fin(path);
+        follow_load(ud, cgemma::snapshot::load(ud, fin.buffer(), fin.size()));
+      }
+    }
     lua_pushboolean(L, 1);
     return 1;
   } catch (const std::exception& e) {
+    if (ud->spec()) {
+      ud->spec()->invalidate();
+    }
     lua_pushboolean(L, 0);
     lua_pushstring(L, e.what());
     return 2;
@@ -287,7 +552,14 @@ int load(lua_State* L) {
 }
 
 int stats(lua_State* L) {
-  cgemma::push_timing(L, cgemma::session::check(L, 1)->timing_info());
+  auto sess = cgemma::session::check(L, 1);
+  cgemma::push_timing(L, sess->timing_info());
+  if (auto spec = sess->spec()) {
+    lua_pushinteger(L, spec->proposed());
+    lua_setfield(L, -2, "draft_tokens_proposed");
+    lua_pushinteger(L, spec->accepted());
+    lua_setfield(L, -2, "draft_tokens_accepted");
+  }
   return 1;
 }
 
@@ -295,11 +567,198 @@ int stats(lua_State* L) {
 
 namespace cgemma {
 
-session::session(instance* inst, int argc, char* argv[], bool no_wrapping)
+session::session(instance* inst, int argc, char* argv[], bool no_wrapping, bool context_shift, size_t sink_tokens)
   : inst_(inst)
   , args_(argc, argv)
-  , no_wrapping_(no_wrapping) {
-  kv_cache_ = std::make_unique<gcpp::KVCache>(inst_->model().Config(), args_, inst_->threading_ctx().allocator);
+  , no_wrapping_(no_wrapping)
+  , context_shift_(context_shift)
+  , sink_tokens_(sink_tokens)
+  , kv_offload_(inst->kv_offload())
+  , filter_(inst->filter())
+  , rng_(std::random_device()()) {
+  // The KV cache is checked out when the session is first used.
+}
+
+session::session(session* parent)
+  : inst_(parent->inst_)
+  , args_(parent->args_)
+  , no_wrapping_(parent->no_wrapping_)
+  , context_shift_(parent->context_shift_)
+  , sink_tokens_(parent->sink_tokens_)
+  , pos_(parent->pos_)
+  , kv_cache_(parent->kv_cache_)
+  , deferred_src_(parent->deferred_src_)
+  , deferred_rows_(parent->deferred_rows_)
+  , kv_offload_(parent->kv_offload_)
+  , stream_opts_(parent->stream_opts_)
+  , stop_opts_(parent->stop_opts_)
+  , filter_(parent->filter_)
+  , output_tokens_(parent->output_tokens_)
+  , rng_(parent->rng_())
+  , spec_(parent->spec_ ? std::make_unique<speculator>(*parent->spec_) : nullptr)
+  , grammar_(parent->grammar_) {
+  // The KV cache is shared with the parent until either side writes to it.
+}
+
+session::~session() {
+  if (auto offload = kv_offload_.lock()) {
+    offload->forget(this);
+  }
+}
+
+gcpp::KVCache& session::kv_cache() const {
+  fault_in();
+  if (!kv_cache_) {
+    kv_cache_ = inst_->new_kv_cache(args_);
+  }
+  return *kv_cache_;
+}
+
+gcpp::KVCache& session::mutable_kv_cache() {
+  fault_in();
+  if (!kv_cache_ || kv_cache_.use_count() > 1 || deferred_rows_) {
+    auto kv_cache = !kv_cache_ || kv_cache_.use_count() > 1 ? inst_->new_kv_cache(args_) : kv_cache_;
+    auto rows_src = deferred_rows_ ? deferred_rows_ : kv_cache_ ? kv_cache_->kv_cache.RowBytes(0) : nullptr;
+    if (rows_src && inst_->model().Config().KVCacheCols() > 0) {
+      auto& mat = kv_cache->kv_cache;
+      auto rows = std::min(pos_, mat.Rows());
+      std::memcpy(mat.RowBytes(0), rows_src, rows * mat.Stride() * mat.ElementBytes());
+    }
+    kv_cache_ = std::move(kv_cache);
+    deferred_src_.reset();
+    deferred_rows_ = nullptr;
+  }
+  if (auto offload = kv_offload_.lock()) {
+    auto& mat = kv_cache_->kv_cache;
+    offload->touch(this, mat.Rows() * mat.Stride() * mat.ElementBytes());
+  }
+  return *kv_cache_;
+}
+
+std::shared_ptr<gcpp::KVCache> session::shared_kv_cache() {
+  mutable_kv_cache();
+  return kv_cache_;
+}
+
+const void* session::kv_rows() const {
+  fault_in();
+  return deferred_rows_ ? deferred_rows_ : kv_cache().kv_cache.RowBytes(0);
+}
+
+size_t session::capacity() const {
+  return std::min(inst_->max_tokens(), kv_cache().kv_cache.Rows());
+}
+
+size_t session::make_room(size_t n) {
+  if (!context_shift_ || pos_ + n <= capacity()) {
+    return 0;
+  }
+  auto sink = std::min(sink_tokens_, pos_);
+  if (n > capacity() - sink) {
+    throw std::invalid_argument("Prompt is too long to shift the context.");
+  }
+  // Discard at least half of the window, so shifting does not happen on
+  // every turn.
+  auto window = pos_ - sink;
+  auto discard = std::min(std::max(pos_ + n - capacity(), window / 2), window);
+  shift_context(mutable_kv_cache(), inst_->model().Config(), pos_, sink, discard);
+  pos_ -= discard;
+  return discard;
+}
+
+void session::set_spec(std::unique_ptr<speculator> spec) {
+  spec_ = std::move(spec);
+}
+
+void session::reset() {
+  pos_ = 0;
+  kv_cache_.reset();
+  deferred_src_.reset();
+  deferred_rows_ = nullptr;
+  spilled_.clear();
+  if (auto offload = kv_offload_.lock()) {
+    offload->forget(this);
+  }
+  if (spec_) {
+    spec_->reset();
+  }
+}
+
+void session::defer_rows(std::shared_ptr<const void> src, const void* rows) {
+  deferred_src_ = std::move(src);
+  deferred_rows_ = rows;
+  spilled_.clear();
+}
+
+void session::spill(const std::filesystem::path& dir) {
+  if (busy_) {
+    return;
+  }
+  if (kv_cache_ && !deferred_rows_ && pos_ > 0 && inst_->model().Config().KVCacheCols() > 0) {
+    if (dir.empty()) {
+      snapshot::options opts;
+#ifdef CGEMMA_WITH_ZLIB
+      opts.kv_encoding = snapshot::encoding::deflate;
+#else
+      // Without zlib, f32 rows are halved by rounding them to bf16.
+      if (kv_cache_->kv_cache.ElementBytes() == sizeof(float)) {
+        opts.kv_encoding = snapshot::encoding::bf16;
+      }
+#endif
+      snapshot::dumper dumper(this, opts);
+      std::vector<char> buf(dumper.size());
+      dumper.write(buf.data());
+      spilled_ = std::move(buf);
+    } else {
+      auto& mat = kv_cache_->kv_cache;
+      auto len = std::min(pos_, mat.Rows()) * mat.Stride() * mat.ElementBytes();
+      auto path = dir / ("cgemma-" + std::to_string(getpid()) + "-" + std::to_string(reinterpret_cast<uintptr_t>(this)) + ".kv");
+      {
+        utils::file_writer fout(path, len);
+        std::memcpy(fout.buffer(), mat.RowBytes(0), len);
+      }
+      // The mapping stays valid after the file is unlinked, its pages are
+      // backed by the file and can be dropped under memory pressure.
+      auto fin = std::make_shared<utils::file_reader>(path, false);
+      std::filesystem::remove(path);
+      auto rows = fin->buffer();
+      defer_rows(std::move(fin), rows);
+    }
+  }
+  kv_cache_.reset();
+}
+
+void session::fault_in() const {
+  if (spilled_.empty()) {
+    return;
+  }
+  auto spilled = std::move(spilled_);
+  spilled_.clear();
+  auto self = const_cast<session*>(this);
+  auto pos = pos_;
+  try {
+    snapshot::load(self, spilled.data(), spilled.size());
+  } catch (...) {
+    spilled_ = std::move(spilled);
+    throw;
+  }
+  self->pos_ = pos;
+}
+
+std::vector<int> session::read_prompt(lua_State* L, int index, const gcpp::ImageTokens* image) const {
+  if (lua_istable(L, index)) {
+    if (image) {
+      throw std::invalid_argument("Token prompts cannot be combined with images.");
+    }
+    auto prompt = inst_->read_tokens(L, index);
+    if (prompt.empty()) {
+      throw std::invalid_argument("Prompt must not be empty.");
+    }
+    return prompt;
+  }
+  size_t len;
+  auto text = luaL_checklstring(L, index, &len);
+  return image ? tokenize(*image, text, len) : tokenize(text, len);
 }
 
 std::vector<int> session::tokenize(const char* text, size_t len) const {
@@ -332,6 +791,21 @@ std::vector<int> session::tokenize(const gcpp::ImageTokens& image, const char* t
   }
 }
 
+size_t session::restore_prefix(const std::vector<int>& prompt) {
+  if (!inst_->prefix_cache() || pos_ != 0 || prompt.size() < 2) {
+    return 0;
+  }
+  // At least one prompt token must be left for the model to process.
+  pos_ = inst_->prefix_cache()->restore(prompt, prompt.size() - 1, mutable_kv_cache());
+  return pos_;
+}
+
+void session::cache_prefix(const std::vector<int>& prompt) {
+  if (inst_->prefix_cache() && !prompt.empty()) {
+    inst_->prefix_cache()->insert(prompt, std::min(prompt.size() - 1, pos_), kv_cache());
+  }
+}
+
 void session::declare(lua_State* L) {
   constexpr const luaL_Reg metatable[] = {
     {"__call", call},
@@ -340,10 +814,15 @@ void session::declare(lua_State* L) {
   };
   constexpr const luaL_Reg methods[] = {
     {"ready", ready},
-    {"reset", reset},
+    {"reset", ::reset},
+    {"fork", fork},
+    {"prefill", ::prefill},
+    {"score", ::score},
+    {"async", task::create},
     {"dumps", dumps},
     {"loads", loads},
     {"dump", dump},
+    {"dump_delta", dump_delta},
     {"load", load},
     {"stats", stats},
     {nullptr, nullptr}
@@ -357,6 +836,20 @@ void session::declare(lua_State* L) {
   lua_setfield(L, -2, "__index");
 }
 
+session* session::push_fork(lua_State* L, session* parent) {
+  auto ud = lua_newuserdata(L, sizeof(session));
+  try {
+    parent->fault_in();
+    auto sess = new(ud) session(parent);
+    luaL_getmetatable(L, name);
+    lua_setmetatable(L, -2);
+    return sess;
+  } catch (...) {
+    lua_pop(L, 1);
+    throw;
+  }
+}
+
 session* session::check(lua_State* L, int index) {
   return static_cast<session*>(luaL_checkudata(L, index, name));
 }
@@ -376,6 +869,19 @@ int session::create(lua_State* L) {
   int argc = 1;
   char* argv[n * 2 + 1] = {const_cast<char*>("lua-cgemma")};
   bool no_wrapping = false;
+  bool context_shift = false;
+  lua_Integer sink_tokens = 4;
+  auto has_seed = false;
+  stream_options stream_opts;
+  bool output_tokens = false;
+  lua_Integer seed = 0;
+  stop_options stop_opts;
+  instance* draft = nullptr;
+  lua_Integer ngram = 0;
+  lua_Integer draft_tokens = 4;
+  std::shared_ptr<grammar> g;
+  auto filter = std::make_shared<token_filter>(inst->pieces().size());
+  auto has_filter = false;
   if (nargs >= 2) {
     luaL_checktype(L, 2, LUA_TTABLE);
     for (auto opt: available_options) {
@@ -391,10 +897,171 @@ int session::create(lua_State* L) {
     lua_getfield(L, 2, "no_wrapping");
     no_wrapping = lua_toboolean(L, -1) ? true : false;
     lua_pop(L, 1);
+    lua_getfield(L, 2, "context_shift");
+    context_shift = lua_toboolean(L, -1) ? true : false;
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "sink_tokens");
+    if (!lua_isnil(L, -1)) {
+      sink_tokens = lua_tointeger(L, -1);
+      if (sink_tokens < 0) {
+        luaL_argerror(L, 2, "sink_tokens must not be negative");
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "stream_chunk");
+    if (!lua_isnil(L, -1)) {
+      auto v = lua_tointeger(L, -1);
+      if (v <= 0) {
+        luaL_argerror(L, 2, "stream_chunk must be positive");
+      }
+      stream_opts.chunk_tokens = v;
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "stream_interval");
+    if (!lua_isnil(L, -1)) {
+      auto v = lua_tointeger(L, -1);
+      if (v < 0) {
+        luaL_argerror(L, 2, "stream_interval must not be negative");
+      }
+      stream_opts.interval = std::chrono::microseconds(v);
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "output_tokens");
+    output_tokens = lua_toboolean(L, -1) ? true : false;
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "stream_prefill");
+    stream_opts.prefill = lua_isnil(L, -1) || lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "stop");
+    if (lua_isstring(L, -1)) {
+      size_t len;
+      auto str = lua_tolstring(L, -1, &len);
+      if (len == 0) {
+        luaL_argerror(L, 2, "stop must be a non-empty string or an array of them");
+      }
+      stop_opts.strings.emplace_back(str, len);
+    } else if (lua_istable(L, -1)) {
+      for (size_t i = 1; i <= lua_objlen(L, -1); ++i) {
+        lua_rawgeti(L, -1, i);
+        size_t len;
+        auto str = lua_tolstring(L, -1, &len);
+        if (!str || len == 0) {
+          luaL_argerror(L, 2, "stop must be a non-empty string or an array of them");
+        }
+        stop_opts.strings.emplace_back(str, len);
+        lua_pop(L, 1);
+      }
+    } else if (!lua_isnil(L, -1)) {
+      luaL_argerror(L, 2, "stop must be a non-empty string or an array of them");
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "stop_tokens");
+    if (!lua_isnil(L, -1)) {
+      if (!lua_istable(L, -1)) {
+        luaL_argerror(L, 2, "stop_tokens must be an array of token arrays");
+      }
+      for (size_t i = 1; i <= lua_objlen(L, -1); ++i) {
+        lua_rawgeti(L, -1, i);
+        if (!lua_istable(L, -1) || lua_objlen(L, -1) == 0) {
+          luaL_argerror(L, 2, "stop_tokens must be an array of token arrays");
+        }
+        std::vector<int> seq;
+        for (size_t j = 1; j <= lua_objlen(L, -1); ++j) {
+          lua_rawgeti(L, -1, j);
+          if (!lua_isnumber(L, -1)) {
+            luaL_argerror(L, 2, "stop_tokens must be an array of token arrays");
+          }
+          seq.push_back(lua_tointeger(L, -1));
+          lua_pop(L, 1);
+        }
+        stop_opts.sequences.push_back(std::move(seq));
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "seed");
+    if (!lua_isnil(L, -1)) {
+      has_seed = true;
+      seed = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "draft");
+    if (!lua_isnil(L, -1)) {
+      draft = instance::check(L, lua_gettop(L));
+      if (draft->pieces().size() != inst->pieces().size()) {
+        luaL_argerror(L, 2, "draft must share the tokenizer of the instance");
+      }
+      if (context_shift) {
+        luaL_argerror(L, 2, "draft does not work with context_shift");
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "ngram");
+    if (!lua_isnil(L, -1)) {
+      ngram = lua_tointeger(L, -1);
+      if (ngram < 0) {
+        luaL_argerror(L, 2, "ngram must not be negative");
+      }
+      if (ngram > 0 && draft) {
+        luaL_argerror(L, 2, "ngram and draft must not be used together");
+      }
+      if (ngram > 0 && context_shift) {
+        luaL_argerror(L, 2, "ngram does not work with context_shift");
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "draft_tokens");
+    if (!lua_isnil(L, -1)) {
+      draft_tokens = lua_tointeger(L, -1);
+      if (draft_tokens <= 0) {
+        luaL_argerror(L, 2, "draft_tokens must be positive");
+      }
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, 2, "grammar");
+    if (!lua_isnil(L, -1)) {
+      g = grammar::check(L, lua_gettop(L));
+      if (g->inst() != inst) {
+        luaL_argerror(L, 2, "grammar must be compiled for the instance");
+      }
+      if (draft || ngram > 0) {
+        luaL_argerror(L, 2, "grammar does not work with speculative decoding");
+      }
+    }
+    lua_pop(L, 1);
+    // Read before the session is constructed, a session without its
+    // metatable would never be destroyed.
+    try {
+      has_filter = read_filter_options(L, 2, inst, *filter);
+    } catch (const std::exception& e) {
+      lua_pushnil(L);
+      lua_pushstring(L, e.what());
+      return 2;
+    }
   }
   auto ud = lua_newuserdata(L, sizeof(session));
   try {
-    auto sess = new(ud) session(inst, argc, argv, no_wrapping);
+    // Nothing may throw once the session is constructed, until it has its
+    // metatable.
+    std::unique_ptr<speculator> spec;
+    if (draft) {
+      spec = std::make_unique<speculator>(draft, argc, argv, no_wrapping, draft_tokens);
+    } else if (ngram > 0) {
+      spec = std::make_unique<speculator>(ngram, draft_tokens);
+    }
+    auto sess = new(ud) session(inst, argc, argv, no_wrapping, context_shift, sink_tokens);
+    if (has_seed) {
+      sess->rng().seed(seed);
+    }
+    sess->set_stream_opts(stream_opts);
+    sess->set_output_tokens(output_tokens);
+    sess->set_stop_opts(std::move(stop_opts));
+    sess->set_spec(std::move(spec));
+    sess->set_constraint(std::move(g));
+    if (has_filter) {
+      filter->merge(*inst->filter());
+      sess->set_filter(std::move(filter));
+    }
     luaL_getmetatable(L, name);
     lua_setmetatable(L, -2);
     return 1;
@@ -413,14 +1080,27 @@ std::vector<int> session::tokenize_text(const std::string& text) const {
   if (!inst_->model().Tokenizer().Encode(text, &prompt)) {
     throw std::runtime_error("Tokenizer encoding failed. (session::tokenize_text)");
   }
-  if (!inst_->disabled_tokens().empty()) {
+  if (!filter_->empty()) {
     std::replace_if(prompt.begin(), prompt.end(), [&](int token) {
-      return inst_->disabled_tokens().find(token) != inst_->disabled_tokens().end();
+      return !filter_->enabled(token);
     }, UNK_ID);
   }
   return prompt;
 }
 
+void push_output(lua_State* L, const session* sess, const std::vector<int>& output) {
+  if (sess->output_tokens()) {
+    lua_createtable(L, output.size(), 0);
+    for (size_t i = 0; i < output.size(); ++i) {
+      lua_pushinteger(L, output[i]);
+      lua_rawseti(L, -2, i + 1);
+    }
+  } else {
+    auto resp = detokenize(sess->inst()->pieces(), output);
+    lua_pushlstring(L, resp.data(), resp.size());
+  }
+}
+
 void push_timing(lua_State*L, const gcpp::TimingInfo& timing) {
   lua_newtable(L);
   lua_pushnumber(L, timing.prefill_duration);
@@ -1,36 +1,92 @@
 #ifndef CGEMMA_SESSION_HPP
 #define CGEMMA_SESSION_HPP
 
+#include "stream_buffer.hpp"
+#include "stop_matcher.hpp"
+#include "token_filter.hpp"
 #include <lua.hpp>
 #include <gemma/gemma.h>
 #include <gemma/gemma_args.h>
 #include <paligemma/image.h>
+#include <filesystem>
 #include <string>
 #include <vector>
+#include <memory>
+#include <random>
 
 namespace cgemma {
 
 class instance;
+class kv_offload;
+class speculator;
+class grammar;
 
 class session {
 public:
-  session(instance* inst, int argc, char* argv[], bool no_wrapping);
+  session(instance* inst, int argc, char* argv[], bool no_wrapping, bool context_shift, size_t sink_tokens);
+  // Forks `parent`, the random generator of the fork is seeded from that of
+  // the parent, so they do not sample the same continuations.
+  explicit session(session* parent);
+  ~session();
 
   instance* inst() const { return inst_; }
   const gcpp::InferenceArgs& args() const { return args_; }
   size_t pos() const { return pos_; }
-  gcpp::KVCache& kv_cache() const { return *kv_cache_; }
+  bool context_shift() const { return context_shift_; }
+  // A session is busy while a task is generating in it.
+  bool busy() const { return busy_; }
+  size_t capacity() const;
+  gcpp::KVCache& kv_cache() const;
+  gcpp::KVCache& mutable_kv_cache();
+  // Same as mutable_kv_cache(), but the caller shares the ownership, so the
+  // KV cache outlives a reset of the session.
+  std::shared_ptr<gcpp::KVCache> shared_kv_cache();
+  const void* kv_rows() const;
   const gcpp::TimingInfo& timing_info() const { return timing_info_; }
   gcpp::TimingInfo& timing_info() { return timing_info_; }
+  std::mt19937& rng() { return rng_; }
+  const stream_options& stream_opts() const { return stream_opts_; }
+  const stop_options& stop_opts() const { return stop_opts_; }
+  const token_filter& filter() const { return *filter_; }
+  bool output_tokens() const { return output_tokens_; }
+  // Null unless the session decodes speculatively with a draft model.
+  speculator* spec() const { return spec_.get(); }
+  // Null unless generation is constrained by a grammar.
+  const std::shared_ptr<grammar>& constraint() const { return grammar_; }
 
   void set_pos(size_t pos) { pos_ = pos; }
+  void set_busy(bool busy) { busy_ = busy; }
+  void set_stream_opts(const stream_options& opts) { stream_opts_ = opts; }
+  void set_stop_opts(stop_options&& opts) { stop_opts_ = std::move(opts); }
+  void set_filter(std::shared_ptr<const token_filter> filter) { filter_ = std::move(filter); }
+  void set_output_tokens(bool output_tokens) { output_tokens_ = output_tokens; }
+  void set_spec(std::unique_ptr<speculator> spec);
+  void set_constraint(std::shared_ptr<grammar> g) { grammar_ = std::move(g); }
+  void reset();
+  // Discards KV cache rows in the middle of the context when `n` more tokens
+  // do not fit, returns the number of rows discarded.
+  size_t make_room(size_t n);
+  void defer_rows(std::shared_ptr<const void> src, const void* rows);
+  // Releases the KV cache, its rows are written to a file in `dir` and mapped
+  // back lazily, or compressed in memory if `dir` is empty. Busy sessions
+  // are left as they are.
+  void spill(const std::filesystem::path& dir);
+  // Decompresses the KV cache rows spilled to memory, if any.
+  void fault_in() const;
 
   std::vector<int> tokenize(const char* text, size_t len) const;
   std::vector<int> tokenize(const gcpp::ImageTokens& image, const char* text, size_t len) const;
+  // Reads the prompt at `index`, either a string to tokenize or an array of
+  // token IDs used as is.
+  std::vector<int> read_prompt(lua_State* L, int index, const gcpp::ImageTokens* image) const;
   void embed(const gcpp::Image& img);
+  size_t restore_prefix(const std::vector<int>& prompt);
+  void cache_prefix(const std::vector<int>& prompt);
 
   static void declare(lua_State* L);
   static session* check(lua_State* L, int index);
+  // Pushes a fork of `parent` onto the stack.
+  static session* push_fork(lua_State* L, session* parent);
   static int create(lua_State* L);
 
 private:
@@ -39,12 +95,31 @@ private:
   instance* inst_;
   gcpp::InferenceArgs args_;
   bool no_wrapping_;
+  bool context_shift_;
+  size_t sink_tokens_;
   size_t pos_ {0};
-  std::unique_ptr<gcpp::KVCache> kv_cache_;
+  bool busy_ {false};
+  // Checked out lazily, so sessions that are reset hold no KV cache.
+  mutable std::shared_ptr<gcpp::KVCache> kv_cache_;
+  std::shared_ptr<const void> deferred_src_;
+  const void* deferred_rows_ {nullptr};
+  mutable std::vector<char> spilled_;
+  std::weak_ptr<kv_offload> kv_offload_;
   gcpp::TimingInfo timing_info_;
+  stream_options stream_opts_;
+  stop_options stop_opts_;
+  // Shared with the instance unless the session has options of its own.
+  std::shared_ptr<const token_filter> filter_;
+  bool output_tokens_ {false};
+  std::mt19937 rng_;
+  std::unique_ptr<speculator> spec_;
+  std::shared_ptr<grammar> grammar_;
 };
 
 void push_timing(lua_State*L, const gcpp::TimingInfo& timing);
+// Pushes a reply as a string, or as an array of token IDs if the session
+// asks for them.
+void push_output(lua_State* L, const session* sess, const std::vector<int>& output);
 
 }
 
@@ -0,0 +1,995 @@
+#include "snapshot.hpp"
+#include "session.hpp"
+#include "instance.hpp"
+#include "speculative.hpp"
+#include "utils/convert.hpp"
+#ifdef CGEMMA_WITH_ZLIB
+#include <zlib.h>
+#endif
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+
+namespace {
+
+constexpr const char magic[] = "cgemma.session";
+// Version 1 stores the model type right after the magic string, this byte
+// never collides with a model type.
+constexpr const uint8_t v2_marker = 0xff;
+constexpr const uint8_t version = 2;
+// Payloads are aligned to the largest common page size, so the rows of a
+// mapped dump start on a page on both 4K and 16K page systems.
+constexpr const size_t alignment = 16384;
+// Number of elements sharing a scale in int8 encoded rows.
+constexpr const size_t int8_group = 128;
+
+enum class field_id: uint32_t {
+  kv_cache,
+  tokens
+};
+
+enum header_flags: uint32_t {
+  has_checksum = 1
+};
+
+struct header {
+  char magic[sizeof(::magic) - 1];
+  uint8_t marker;
+  uint8_t version;
+  uint32_t model;
+  uint32_t flags;
+  uint64_t pos;
+  uint32_t num_fields;
+  uint32_t alignment;
+  uint64_t checksum;
+};
+
+static_assert(sizeof(header) == 48, "Unexpected snapshot header size");
+
+struct field_entry {
+  uint32_t id;
+  uint32_t encoding;
+  uint64_t offset;
+  uint64_t length;
+  uint64_t first_row;
+  uint64_t rows;
+  uint64_t row_bytes;
+};
+
+static_assert(sizeof(field_entry) == 48, "Unexpected snapshot field entry size");
+
+class hasher {
+public:
+  void update(const void* data, size_t n) {
+    auto p = static_cast<const uint8_t*>(data);
+    len_ += n;
+    while (n > 0 && tail_len_ > 0) {
+      tail_ |= static_cast<uint64_t>(*p++) << (tail_len_++ * 8);
+      --n;
+      if (tail_len_ == sizeof(uint64_t)) {
+        mix(tail_);
+        tail_ = 0;
+        tail_len_ = 0;
+      }
+    }
+    for (; n >= sizeof(uint64_t); p += sizeof(uint64_t), n -= sizeof(uint64_t)) {
+      uint64_t w;
+      std::memcpy(&w, p, sizeof(w));
+      mix(w);
+    }
+    while (n-- > 0) {
+      tail_ |= static_cast<uint64_t>(*p++) << (tail_len_++ * 8);
+    }
+  }
+
+  uint64_t digest() const {
+    auto h = h_;
+    if (tail_len_ > 0) {
+      h = round(h, tail_);
+    }
+    h ^= len_;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+private:
+  static uint64_t round(uint64_t h, uint64_t w) {
+    h ^= w * 0x9e3779b97f4a7c15ULL;
+    h = (h << 31) | (h >> 33);
+    return h * 0xbf58476d1ce4e5b9ULL;
+  }
+
+  void mix(uint64_t w) { h_ = round(h_, w); }
+
+  uint64_t h_ {0x2545f4914f6cdd1dULL};
+  uint64_t tail_ {0};
+  size_t tail_len_ {0};
+  uint64_t len_ {0};
+};
+
+using cgemma::snapshot::encoding;
+
+struct kv_layout {
+  size_t rows;
+  size_t row_bytes;
+  size_t cols;
+  size_t element_bytes;
+};
+
+// Layout of the KV cache rows from `first_row` up to `pos`.
+kv_layout layout_of(const cgemma::session* sess, size_t pos, size_t first_row = 0) {
+  if (sess->inst()->model().Config().KVCacheCols() == 0) {
+    return {0, 0, 0, 0};
+  }
+  auto& kv_cache = sess->kv_cache().kv_cache;
+  auto rows = std::min(pos, kv_cache.Rows());
+  return {rows - std::min(first_row, rows), kv_cache.Stride() * kv_cache.ElementBytes(), kv_cache.Cols(), kv_cache.ElementBytes()};
+}
+
+// Rows of a delta must not have wrapped around the KV cache, otherwise the
+// rows it is based on have been overwritten.
+void check_delta(const cgemma::session* sess, size_t first_row, size_t pos) {
+  if (first_row > pos) {
+    throw std::invalid_argument("First row of delta exceeds the position");
+  }
+  if (first_row > 0 && pos > sess->kv_cache().kv_cache.Rows()) {
+    throw std::invalid_argument("Delta is not supported once the KVCache wrapped around");
+  }
+}
+
+size_t int8_groups(const kv_layout& kv) {
+  return (kv.cols + int8_group - 1) / int8_group;
+}
+
+// Returns the length of the encoded rows, 0 for variable-length encodings.
+size_t encoded_length(const kv_layout& kv, encoding enc) {
+  switch (enc) {
+    case encoding::raw:
+      return kv.rows * kv.row_bytes;
+    case encoding::bf16:
+      return kv.rows * kv.cols * sizeof(hwy::bfloat16_t);
+    case encoding::int8:
+      return kv.rows * (int8_groups(kv) * sizeof(float) + kv.cols);
+    default:
+      return 0;
+  }
+}
+
+void check_element_type(const kv_layout& kv) {
+  if (kv.element_bytes != sizeof(float) && kv.element_bytes != sizeof(hwy::bfloat16_t)) {
+    throw std::invalid_argument("Unsupported KVCache element type");
+  }
+}
+
+// Returns a row of the KV cache as f32, `tmp` is used when it is stored in
+// another type.
+const float* row_to_f32(const char* row, const kv_layout& kv, float* tmp) {
+  if (kv.element_bytes == sizeof(float)) {
+    return reinterpret_cast<const float*>(row);
+  }
+  cgemma::utils::bf16_to_f32(reinterpret_cast<const hwy::bfloat16_t*>(row), kv.cols, tmp);
+  return tmp;
+}
+
+void row_from_f32(const float* in, const kv_layout& kv, char* row) {
+  if (kv.element_bytes == sizeof(float)) {
+    std::memcpy(row, in, kv.cols * sizeof(float));
+  } else {
+    cgemma::utils::f32_to_bf16(in, kv.cols, reinterpret_cast<hwy::bfloat16_t*>(row));
+  }
+}
+
+void encode_bf16_row(const char* row, const kv_layout& kv, char* out) {
+  if (kv.element_bytes == sizeof(hwy::bfloat16_t)) {
+    std::memcpy(out, row, kv.cols * sizeof(hwy::bfloat16_t));
+  } else {
+    cgemma::utils::f32_to_bf16(reinterpret_cast<const float*>(row), kv.cols, reinterpret_cast<hwy::bfloat16_t*>(out));
+  }
+}
+
+void decode_bf16_row(const char* in, const kv_layout& kv, char* row) {
+  if (kv.element_bytes == sizeof(hwy::bfloat16_t)) {
+    std::memcpy(row, in, kv.cols * sizeof(hwy::bfloat16_t));
+  } else {
+    cgemma::utils::bf16_to_f32(reinterpret_cast<const hwy::bfloat16_t*>(in), kv.cols, reinterpret_cast<float*>(row));
+  }
+}
+
+// Layout of int8 encoded rows: the scales of all groups of all rows, followed
+// by the quantized values of all rows.
+void encode_int8_row(const char* row, const kv_layout& kv, float* scales, int8_t* values, float* tmp) {
+  auto in = row_to_f32(row, kv, tmp);
+  for (size_t i = 0; i < int8_groups(kv); ++i) {
+    auto offset = i * int8_group;
+    scales[i] = cgemma::utils::f32_to_i8(in + offset, std::min(int8_group, kv.cols - offset), values + offset);
+  }
+}
+
+void decode_int8_row(const float* scales, const int8_t* values, const kv_layout& kv, char* row, float* tmp) {
+  for (size_t i = 0; i < int8_groups(kv); ++i) {
+    auto offset = i * int8_group;
+    cgemma::utils::i8_to_f32(values + offset, std::min(int8_group, kv.cols - offset), scales[i], tmp + offset);
+  }
+  row_from_f32(tmp, kv, row);
+}
+
+void decode_bf16(const char* in, const kv_layout& kv, char* rows) {
+  auto row_len = kv.cols * sizeof(hwy::bfloat16_t);
+  for (size_t i = 0; i < kv.rows; ++i) {
+    decode_bf16_row(in + i * row_len, kv, rows + i * kv.row_bytes);
+  }
+}
+
+void decode_int8(const char* in, const kv_layout& kv, char* rows) {
+  auto groups = int8_groups(kv);
+  std::vector<float> scales(kv.rows * groups);
+  std::memcpy(scales.data(), in, scales.size() * sizeof(float));
+  auto values = reinterpret_cast<const int8_t*>(in + scales.size() * sizeof(float));
+  std::vector<float> tmp(kv.cols);
+  for (size_t i = 0; i < kv.rows; ++i) {
+    decode_int8_row(scales.data() + i * groups, values + i * kv.cols, kv, rows + i * kv.row_bytes, tmp.data());
+  }
+}
+
+#ifdef CGEMMA_WITH_ZLIB
+
+// Bytes of the same significance are grouped together before compressing,
+// which makes the exponent bytes of KV values highly compressible.
+void shuffle(const char* row, const kv_layout& kv, char* out) {
+  for (size_t i = 0; i < kv.cols; ++i) {
+    for (size_t j = 0; j < kv.element_bytes; ++j) {
+      out[j * kv.cols + i] = row[i * kv.element_bytes + j];
+    }
+  }
+}
+
+void unshuffle(const char* in, const kv_layout& kv, char* row) {
+  for (size_t i = 0; i < kv.cols; ++i) {
+    for (size_t j = 0; j < kv.element_bytes; ++j) {
+      row[i * kv.element_bytes + j] = in[j * kv.cols + i];
+    }
+  }
+}
+
+class deflate_stream: public z_stream {
+public:
+  deflate_stream() : z_stream() {
+    if (deflateInit(this, Z_BEST_SPEED) != Z_OK) {
+      throw std::runtime_error("Failed to initialize deflate stream");
+    }
+  }
+
+  ~deflate_stream() { deflateEnd(this); }
+
+  deflate_stream(const deflate_stream&) = delete;
+  deflate_stream& operator=(const deflate_stream&) = delete;
+};
+
+class inflate_stream: public z_stream {
+public:
+  inflate_stream() : z_stream() {
+    if (inflateInit(this) != Z_OK) {
+      throw std::runtime_error("Failed to initialize inflate stream");
+    }
+  }
+
+  ~inflate_stream() { inflateEnd(this); }
+
+  inflate_stream(const inflate_stream&) = delete;
+  inflate_stream& operator=(const inflate_stream&) = delete;
+};
+
+std::vector<char> encode_deflate(const char* rows, const kv_layout& kv) {
+  constexpr const size_t chunk_size = 1 << 20;
+  std::vector<char> out;
+  if (kv.rows == 0) {
+    return out;
+  }
+  std::vector<char> tmp(kv.cols * kv.element_bytes);
+  deflate_stream zs;
+  for (size_t i = 0; i < kv.rows; ++i) {
+    shuffle(rows + i * kv.row_bytes, kv, tmp.data());
+    zs.next_in = reinterpret_cast<Bytef*>(tmp.data());
+    zs.avail_in = tmp.size();
+    auto flush = i + 1 < kv.rows ? Z_NO_FLUSH : Z_FINISH;
+    for (;;) {
+      if (zs.avail_out == 0) {
+        out.resize(out.size() + chunk_size);
+        zs.next_out = reinterpret_cast<Bytef*>(out.data() + zs.total_out);
+        zs.avail_out = out.size() - zs.total_out;
+      }
+      auto ret = deflate(&zs, flush);
+      if (ret == Z_STREAM_ERROR) {
+        throw std::runtime_error("Failed to compress KVCache");
+      }
+      if (flush == Z_FINISH ? ret == Z_STREAM_END : zs.avail_in == 0 && zs.avail_out > 0) {
+        break;
+      }
+    }
+  }
+  out.resize(zs.total_out);
+  return out;
+}
+
+// Decompresses deflate encoded rows fed in arbitrary slices.
+class inflater {
+public:
+  inflater(const kv_layout& kv, char* rows)
+    : kv_(kv)
+    , rows_(rows)
+    , tmp_(kv.cols * kv.element_bytes) {
+    // nop
+  }
+
+  void update(const char* in, size_t n) {
+    while (n > 0) {
+      // avail_in is only 32 bits, large payloads are fed in slices.
+      auto slice = std::min<size_t>(n, 1 << 30);
+      zs_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in));
+      zs_.avail_in = slice;
+      in += slice;
+      n -= slice;
+      while (zs_.avail_in > 0) {
+        if (ended_) {
+          throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+        }
+        // Anything inflated after the last row is an error.
+        char trailing;
+        auto out = row_ < kv_.rows ? tmp_.data() + filled_ : &trailing;
+        auto room = row_ < kv_.rows ? tmp_.size() - filled_ : 1;
+        zs_.next_out = reinterpret_cast<Bytef*>(out);
+        zs_.avail_out = room;
+        auto ret = inflate(&zs_, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+          throw std::invalid_argument("Invalid dump format: corrupted KVCache");
+        }
+        auto produced = room - zs_.avail_out;
+        if (row_ == kv_.rows && produced > 0) {
+          throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+        }
+        filled_ += produced;
+        if (row_ < kv_.rows && filled_ == tmp_.size()) {
+          unshuffle(tmp_.data(), kv_, rows_ + row_++ * kv_.row_bytes);
+          filled_ = 0;
+        }
+        ended_ = ret == Z_STREAM_END;
+      }
+    }
+  }
+
+  void finish() const {
+    // Nothing is compressed when there are no rows.
+    if (row_ < kv_.rows || (zs_.total_in > 0 && !ended_)) {
+      throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+    }
+  }
+
+private:
+  kv_layout kv_;
+  char* rows_;
+  std::vector<char> tmp_;
+  inflate_stream zs_;
+  size_t row_ {0};
+  size_t filled_ {0};
+  bool ended_ {false};
+};
+
+void decode_deflate(const char* in, size_t n, const kv_layout& kv, char* rows) {
+  inflater z(kv, rows);
+  z.update(in, n);
+  z.finish();
+}
+
+#endif  // CGEMMA_WITH_ZLIB
+
+void decode_rows(cgemma::session* sess, size_t first_row, size_t pos, const kv_layout& kv, encoding enc, const char* data, size_t len) {
+  // Only the rows before the loaded ones have to be preserved.
+  sess->set_pos(first_row);
+  auto rows = kv.rows > 0 ? reinterpret_cast<char*>(sess->mutable_kv_cache().kv_cache.RowBytes(first_row)) : nullptr;
+  switch (enc) {
+    case encoding::bf16:
+      decode_bf16(data, kv, rows);
+      break;
+    case encoding::int8:
+      decode_int8(data, kv, rows);
+      break;
+    case encoding::deflate:
+#ifdef CGEMMA_WITH_ZLIB
+      decode_deflate(data, len, kv, rows);
+      break;
+#else
+      throw std::invalid_argument("Deflate encoding is not supported by this build");
+#endif
+    default:
+      throw std::invalid_argument("Invalid dump format: unsupported KVCache encoding");
+  }
+  sess->set_pos(pos);
+}
+
+size_t align_up(size_t n) {
+  return (n + alignment - 1) / alignment * alignment;
+}
+
+void restore_rows(cgemma::session* sess, size_t first_row, size_t pos, const char* rows, size_t len, std::shared_ptr<const cgemma::utils::file_reader> src) {
+  // Lazily loaded rows stay in the mapping, which the gcpp allocator knows
+  // nothing about, and are copied into the KV cache on the first write. Rows
+  // of deltas are restored right away.
+  if (src && first_row == 0) {
+    sess->set_pos(pos);
+    sess->defer_rows(std::move(src), rows);
+    return;
+  }
+  // Only the rows before the loaded ones have to be preserved.
+  sess->set_pos(first_row);
+  auto dst = len > 0 ? sess->mutable_kv_cache().kv_cache.RowBytes(first_row) : nullptr;
+  sess->set_pos(pos);
+  if (len > 0) {
+    std::memcpy(dst, rows, len);
+  }
+}
+
+void load_v1(cgemma::session* sess, const char* buf, size_t n, std::shared_ptr<const cgemma::utils::file_reader> src) {
+  constexpr const size_t header_size = sizeof(magic) + sizeof(uint16_t);
+  if (n < header_size) {
+    throw std::invalid_argument("Invalid dump format: length too short");
+  }
+  auto type = static_cast<gcpp::Model>(buf[sizeof(magic) - 1]);
+  if (type != sess->inst()->model().Config().model) {
+    throw std::invalid_argument("Invalid dump format: model type mismatch");
+  }
+  uint16_t pos;
+  std::memcpy(&pos, buf + sizeof(magic), sizeof(pos));
+  auto kv = layout_of(sess, pos);
+  if (n != header_size + kv.rows * kv.row_bytes) {
+    throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+  }
+  restore_rows(sess, 0, pos, buf + header_size, kv.rows * kv.row_bytes, std::move(src));
+}
+
+void check_header(const cgemma::session* sess, const header& hdr) {
+  if (hdr.version != version) {
+    throw std::invalid_argument("Invalid dump format: unsupported version");
+  }
+  if (hdr.model != static_cast<uint32_t>(sess->inst()->model().Config().model)) {
+    throw std::invalid_argument("Invalid dump format: model type mismatch");
+  }
+}
+
+// Validates the field table following the header of state data of length
+// `n`, returns the layout of the KV cache rows described by `kv_field`. The
+// `row_bytes` of `tokens_field` is 0 if there are no tokens.
+kv_layout check_fields(const cgemma::session* sess, const header& hdr, const char* fields, size_t n, field_entry& kv_field, field_entry& tokens_field) {
+  auto table_end = sizeof(header) + hdr.num_fields * sizeof(field_entry);
+  kv_field = {};
+  tokens_field = {};
+  auto has_kv_field = false;
+  for (uint32_t i = 0; i < hdr.num_fields; ++i) {
+    field_entry field;
+    std::memcpy(&field, fields + i * sizeof(field_entry), sizeof(field));
+    if (field.offset < table_end || field.offset > n || field.length > n - field.offset) {
+      throw std::invalid_argument("Invalid dump format: field out of range");
+    }
+    switch (static_cast<field_id>(field.id)) {
+      case field_id::kv_cache:
+        if (field.encoding > static_cast<uint32_t>(encoding::deflate)) {
+          throw std::invalid_argument("Invalid dump format: unsupported KVCache encoding");
+        }
+        kv_field = field;
+        has_kv_field = true;
+        break;
+      case field_id::tokens:
+        if (field.row_bytes != sizeof(int32_t) || field.rows > field.length / sizeof(int32_t) || field.length != field.rows * sizeof(int32_t)) {
+          throw std::invalid_argument("Invalid dump format: tokens length mismatch");
+        }
+        tokens_field = field;
+        break;
+      default:
+        throw std::invalid_argument("Invalid dump format: unknown field");
+    }
+  }
+  check_delta(sess, kv_field.first_row, hdr.pos);
+  if (kv_field.first_row > sess->pos()) {
+    throw std::invalid_argument("Invalid dump format: delta does not apply to the current state");
+  }
+  if (tokens_field.row_bytes > 0 && (tokens_field.first_row != kv_field.first_row || tokens_field.rows != hdr.pos - kv_field.first_row)) {
+    throw std::invalid_argument("Invalid dump format: tokens length mismatch");
+  }
+  auto kv = layout_of(sess, hdr.pos, kv_field.first_row);
+  if (kv.rows > 0 && !has_kv_field) {
+    throw std::invalid_argument("Invalid dump format: KVCache field missing");
+  }
+  if (has_kv_field) {
+    if (kv_field.encoding != static_cast<uint32_t>(encoding::raw)) {
+      check_element_type(kv);
+    }
+    if (kv_field.rows != kv.rows || kv_field.row_bytes != kv.row_bytes) {
+      throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+    }
+    if (kv_field.encoding != static_cast<uint32_t>(encoding::deflate) && kv_field.length != encoded_length(kv, static_cast<encoding>(kv_field.encoding))) {
+      throw std::invalid_argument("Invalid dump format: KVCache length mismatch");
+    }
+  }
+  return kv;
+}
+
+cgemma::snapshot::token_history read_tokens(const cgemma::session* sess, const field_entry& tokens_field, const char* data) {
+  cgemma::snapshot::token_history history;
+  if (tokens_field.row_bytes == 0) {
+    return history;
+  }
+  history.present = true;
+  history.first_pos = tokens_field.first_row;
+  history.tokens.resize(tokens_field.rows);
+  if (tokens_field.length > 0) {
+    std::memcpy(history.tokens.data(), data, tokens_field.length);
+  }
+  for (auto token: history.tokens) {
+    if (token < 0 || static_cast<size_t>(token) >= sess->inst()->pieces().size()) {
+      throw std::invalid_argument("Invalid dump format: token out of range");
+    }
+  }
+  return history;
+}
+
+cgemma::snapshot::token_history load_v2(cgemma::session* sess, const char* buf, size_t n, std::shared_ptr<const cgemma::utils::file_reader> src) {
+  if (n < sizeof(header)) {
+    throw std::invalid_argument("Invalid dump format: length too short");
+  }
+  header hdr;
+  std::memcpy(&hdr, buf, sizeof(hdr));
+  check_header(sess, hdr);
+  if (hdr.num_fields > (n - sizeof(header)) / sizeof(field_entry)) {
+    throw std::invalid_argument("Invalid dump format: length too short");
+  }
+  // Verifying the checksum would read the whole file, lazy loads skip it.
+  if ((hdr.flags & has_checksum) && !src) {
+    hasher h;
+    h.update(buf + sizeof(header), n - sizeof(header));
+    if (h.digest() != hdr.checksum) {
+      throw std::invalid_argument("Invalid dump format: checksum mismatch");
+    }
+  }
+  field_entry kv_field;
+  field_entry tokens_field;
+  auto kv = check_fields(sess, hdr, buf + sizeof(header), n, kv_field, tokens_field);
+  auto history = read_tokens(sess, tokens_field, buf + tokens_field.offset);
+  if (kv_field.encoding == static_cast<uint32_t>(encoding::raw)) {
+    restore_rows(sess, kv_field.first_row, hdr.pos, buf + kv_field.offset, kv_field.length, std::move(src));
+  } else {
+    // Encoded rows are always expanded eagerly.
+    decode_rows(sess, kv_field.first_row, hdr.pos, kv, static_cast<encoding>(kv_field.encoding), buf + kv_field.offset, kv_field.length);
+  }
+  return history;
+}
+
+// Produces the encoded KV cache rows piece by piece, raw rows and buffered
+// payloads are returned as a whole without copying.
+class payload_reader {
+public:
+  payload_reader(const char* rows, const kv_layout& kv, encoding enc, const std::vector<char>& buffered)
+    : rows_(rows)
+    , kv_(kv)
+    , enc_(enc)
+    , buffered_(buffered) {
+    if (enc == encoding::bf16) {
+      staging_.resize(kv.cols * sizeof(hwy::bfloat16_t));
+    } else if (enc == encoding::int8) {
+      staging_.resize(kv.cols);
+      scales_.resize(int8_groups(kv));
+      tmp_.resize(kv.cols);
+    }
+  }
+
+  // Returns the next piece of the payload, its length is 0 at the end.
+  std::pair<const char*, size_t> next() {
+    switch (enc_) {
+      case encoding::raw:
+        return whole(rows_, kv_.rows * kv_.row_bytes);
+      case encoding::bf16:
+        if (row_ == kv_.rows) {
+          return {nullptr, 0};
+        }
+        encode_bf16_row(rows_ + row_++ * kv_.row_bytes, kv_, staging_.data());
+        return {staging_.data(), staging_.size()};
+      case encoding::int8:
+        if (!scales_done_) {
+          // The scales of all rows come first, the values are quantized again
+          // row by row afterwards.
+          scales_done_ = true;
+          std::vector<float> scales;
+          scales.reserve(kv_.rows * scales_.size());
+          for (size_t i = 0; i < kv_.rows; ++i) {
+            encode_int8_row(rows_ + i * kv_.row_bytes, kv_, scales_.data(), reinterpret_cast<int8_t*>(staging_.data()), tmp_.data());
+            scales.insert(scales.end(), scales_.begin(), scales_.end());
+          }
+          all_scales_ = std::move(scales);
+          return {reinterpret_cast<const char*>(all_scales_.data()), all_scales_.size() * sizeof(float)};
+        }
+        if (row_ == kv_.rows) {
+          return {nullptr, 0};
+        }
+        encode_int8_row(rows_ + row_++ * kv_.row_bytes, kv_, scales_.data(), reinterpret_cast<int8_t*>(staging_.data()), tmp_.data());
+        return {staging_.data(), staging_.size()};
+      default:
+        return whole(buffered_.data(), buffered_.size());
+    }
+  }
+
+private:
+  std::pair<const char*, size_t> whole(const char* data, size_t len) {
+    if (row_ == kv_.rows) {
+      return {nullptr, 0};
+    }
+    row_ = kv_.rows;
+    return {data, len};
+  }
+
+  const char* rows_;
+  kv_layout kv_;
+  encoding enc_;
+  const std::vector<char>& buffered_;
+  size_t row_ {0};
+  bool scales_done_ {false};
+  std::vector<char> staging_;
+  std::vector<float> scales_;
+  std::vector<float> all_scales_;
+  std::vector<float> tmp_;
+};
+
+
+}
+
+namespace cgemma { namespace snapshot {
+
+dumper::dumper(const session* sess, const options& opts)
+  : sess_(sess)
+  , opts_(opts) {
+  check_delta(sess, opts.since, sess->pos());
+  auto history = sess->spec() ? sess->spec()->history() : nullptr;
+  if (history && history->size() == sess->pos()) {
+    has_tokens_ = true;
+    tokens_.assign(history->begin() + opts.since, history->end());
+  }
+  payload_offset_ = align_up(sizeof(header) + (has_tokens_ ? 2 : 1) * sizeof(field_entry));
+  auto kv = layout_of(sess, sess->pos(), opts.since);
+  if (opts.kv_encoding != encoding::raw) {
+    check_element_type(kv);
+  }
+  if (opts.kv_encoding == encoding::deflate) {
+#ifdef CGEMMA_WITH_ZLIB
+    payload_ = encode_deflate(static_cast<const char*>(sess->kv_rows()) + opts.since * kv.row_bytes, kv);
+    size_ = payload_offset_ + payload_.size() + tokens_.size() * sizeof(int32_t);
+#else
+    throw std::invalid_argument("Deflate encoding is not supported by this build");
+#endif
+  } else {
+    size_ = payload_offset_ + encoded_length(kv, opts.kv_encoding) + tokens_.size() * sizeof(int32_t);
+  }
+}
+
+void dumper::write(char* buf) const {
+  write(0, [&](const char* data, size_t n) {
+    std::memcpy(buf, data, n);
+    buf += n;
+  });
+}
+
+void dumper::write(size_t chunk_size, const sink& fn) const {
+  auto kv = layout_of(sess_, sess_->pos(), opts_.since);
+  auto rows = kv.rows > 0 ? static_cast<const char*>(sess_->kv_rows()) + opts_.since * kv.row_bytes : nullptr;
+  header hdr = {};
+  std::memcpy(hdr.magic, magic, sizeof(hdr.magic));
+  hdr.marker = v2_marker;
+  hdr.version = version;
+  hdr.model = static_cast<uint32_t>(sess_->inst()->model().Config().model);
+  hdr.flags = opts_.checksum ? has_checksum : 0;
+  hdr.pos = sess_->pos();
+  hdr.num_fields = has_tokens_ ? 2 : 1;
+  hdr.alignment = alignment;
+  // The tokens follow the KV cache rows, so the rows stay aligned.
+  auto tokens_len = tokens_.size() * sizeof(int32_t);
+  field_entry fields[2] = {};
+  fields[0].id = static_cast<uint32_t>(field_id::kv_cache);
+  fields[0].encoding = static_cast<uint32_t>(opts_.kv_encoding);
+  fields[0].offset = payload_offset_;
+  fields[0].length = size_ - payload_offset_ - tokens_len;
+  fields[0].first_row = opts_.since;
+  fields[0].rows = kv.rows;
+  fields[0].row_bytes = kv.row_bytes;
+  fields[1].id = static_cast<uint32_t>(field_id::tokens);
+  fields[1].offset = size_ - tokens_len;
+  fields[1].length = tokens_len;
+  fields[1].first_row = opts_.since;
+  fields[1].rows = tokens_.size();
+  fields[1].row_bytes = sizeof(int32_t);
+  auto fields_len = hdr.num_fields * sizeof(field_entry);
+  std::vector<char> padding(payload_offset_ - sizeof(header) - fields_len);
+  if (opts_.checksum) {
+    // The checksum is stored in the header, so the payload is read twice.
+    hasher h;
+    h.update(fields, fields_len);
+    h.update(padding.data(), padding.size());
+    payload_reader reader(rows, kv, opts_.kv_encoding, payload_);
+    for (auto piece = reader.next(); piece.second > 0; piece = reader.next()) {
+      h.update(piece.first, piece.second);
+    }
+    h.update(tokens_.data(), tokens_len);
+    hdr.checksum = h.digest();
+  }
+  std::vector<char> staging;
+  staging.reserve(chunk_size);
+  auto emit = [&](const void* data, size_t n) {
+    auto p = static_cast<const char*>(data);
+    while (n > 0) {
+      if (staging.empty() && n >= chunk_size) {
+        // Full slices are passed through without copying.
+        auto len = chunk_size > 0 ? chunk_size : n;
+        fn(p, len);
+        p += len;
+        n -= len;
+        continue;
+      }
+      auto len = std::min(n, chunk_size - staging.size());
+      staging.insert(staging.end(), p, p + len);
+      p += len;
+      n -= len;
+      if (staging.size() == chunk_size) {
+        fn(staging.data(), staging.size());
+        staging.clear();
+      }
+    }
+  };
+  emit(&hdr, sizeof(hdr));
+  emit(fields, fields_len);
+  emit(padding.data(), padding.size());
+  payload_reader reader(rows, kv, opts_.kv_encoding, payload_);
+  for (auto piece = reader.next(); piece.second > 0; piece = reader.next()) {
+    emit(piece.first, piece.second);
+  }
+  emit(tokens_.data(), tokens_len);
+  if (!staging.empty()) {
+    fn(staging.data(), staging.size());
+  }
+}
+
+struct loader::state {
+  explicit state(session* sess)
+    : sess(sess) {
+    // nop
+  }
+
+  // Number of bytes of the header (and the field table) known to be needed
+  // so far.
+  size_t head_size() const {
+    if (head.size() < sizeof(magic)) {
+      return sizeof(magic);
+    }
+    if (static_cast<uint8_t>(head[sizeof(magic) - 1]) != v2_marker) {
+      return sizeof(magic) + sizeof(uint16_t);
+    }
+    if (head.size() < sizeof(header)) {
+      return sizeof(header);
+    }
+    return sizeof(header) + hdr.num_fields * sizeof(field_entry);
+  }
+
+  void parse_head() {
+    if (head.size() == sizeof(magic)) {
+      if (std::memcmp(head.data(), magic, sizeof(magic) - 1) != 0) {
+        throw std::invalid_argument("Invalid dump format: magic mismatch");
+      }
+      return;
+    }
+    if (static_cast<uint8_t>(head[sizeof(magic) - 1]) != v2_marker) {
+      auto type = static_cast<gcpp::Model>(head[sizeof(magic) - 1]);
+      if (type != sess->inst()->model().Config().model) {
+        throw std::invalid_argument("Invalid dump format: model type mismatch");
+      }
+      uint16_t pos;
+      std::memcpy(&pos, head.data() + sizeof(magic), sizeof(pos));
+      hdr.pos = pos;
+      kv = layout_of(sess, pos);
+      prepare(encoding::raw, 0, head.size(), kv.rows * kv.row_bytes);
+      return;
+    }
+    if (head.size() == sizeof(header)) {
+      std::memcpy(&hdr, head.data(), sizeof(hdr));
+      check_header(sess, hdr);
+      if (hdr.num_fields > max_fields) {
+        throw std::invalid_argument("Invalid dump format: too many fields");
+      }
+      if (hdr.num_fields > 0) {
+        return;
+      }
+    }
+    field_entry kv_field;
+    kv = check_fields(sess, hdr, head.data() + sizeof(header), std::numeric_limits<size_t>::max(), kv_field, tokens_field);
+    // Fields are consumed in a single pass, so the tokens must come last.
+    if (tokens_field.row_bytes > 0 && tokens_field.offset < kv_field.offset + kv_field.length) {
+      throw std::invalid_argument("Invalid dump format: tokens out of order");
+    }
+    prepare(static_cast<encoding>(kv_field.encoding), kv_field.first_row, kv_field.offset, kv_field.length);
+  }
+
+  void prepare(encoding e, size_t first, size_t begin, size_t len) {
+    enc = e;
+    first_row = first;
+    payload_begin = begin;
+    payload_len = len;
+    if (enc == encoding::deflate) {
+#ifndef CGEMMA_WITH_ZLIB
+      throw std::invalid_argument("Deflate encoding is not supported by this build");
+#endif
+    }
+    // Only the rows before the loaded ones have to be preserved.
+    sess->set_pos(first_row);
+    rows = kv.rows > 0 ? reinterpret_cast<char*>(sess->mutable_kv_cache().kv_cache.RowBytes(first_row)) : nullptr;
+    switch (enc) {
+      case encoding::bf16:
+        staging.resize(kv.cols * sizeof(hwy::bfloat16_t));
+        break;
+      case encoding::int8:
+        staging.resize(kv.cols);
+        scales.resize(kv.rows * int8_groups(kv));
+        tmp.resize(kv.cols);
+        break;
+#ifdef CGEMMA_WITH_ZLIB
+      case encoding::deflate:
+        z = std::make_unique<inflater>(kv, rows);
+        break;
+#endif
+      default:
+        break;
+    }
+    ready = true;
+  }
+
+  void consume(const char* p, size_t n) {
+    switch (enc) {
+      case encoding::raw:
+        std::memcpy(rows + done, p, n);
+        done += n;
+        return;
+#ifdef CGEMMA_WITH_ZLIB
+      case encoding::deflate:
+        z->update(p, n);
+        done += n;
+        return;
+#endif
+      default:
+        break;
+    }
+    auto scales_len = scales.size() * sizeof(float);
+    while (n > 0) {
+      size_t len;
+      if (done < scales_len) {
+        // The scales of int8 encoded rows come first.
+        len = std::min(n, scales_len - done);
+        std::memcpy(reinterpret_cast<char*>(scales.data()) + done, p, len);
+      } else {
+        len = std::min(n, staging.size() - filled);
+        std::memcpy(staging.data() + filled, p, len);
+        filled += len;
+        if (filled == staging.size()) {
+          auto row_ptr = rows + row * kv.row_bytes;
+          if (enc == encoding::bf16) {
+            decode_bf16_row(staging.data(), kv, row_ptr);
+          } else {
+            decode_int8_row(scales.data() + row * int8_groups(kv), reinterpret_cast<const int8_t*>(staging.data()), kv, row_ptr, tmp.data());
+          }
+          ++row;
+          filled = 0;
+        }
+      }
+      p += len;
+      n -= len;
+      done += len;
+    }
+  }
+
+  static constexpr const uint32_t max_fields = 64;
+
+  session* sess;
+  std::vector<char> head;
+  header hdr {};
+  hasher h;
+  size_t offset {0};
+  bool ready {false};
+  encoding enc {encoding::raw};
+  kv_layout kv {0, 0, 0, 0};
+  size_t first_row {0};
+  size_t payload_begin {0};
+  size_t payload_len {0};
+  field_entry tokens_field {};
+  std::vector<char> token_bytes;
+  char* rows {nullptr};
+  size_t done {0};
+  std::vector<char> staging;
+  size_t filled {0};
+  size_t row {0};
+  std::vector<float> scales;
+  std::vector<float> tmp;
+#ifdef CGEMMA_WITH_ZLIB
+  std::unique_ptr<inflater> z;
+#endif
+};
+
+loader::loader(session* sess)
+  : state_(std::make_unique<state>(sess)) {
+  // nop
+}
+
+loader::~loader() = default;
+
+void loader::update(const char* data, size_t n) {
+  auto& st = *state_;
+  while (n > 0) {
+    size_t len;
+    if (!st.ready) {
+      len = std::min(n, st.head_size() - st.head.size());
+      st.head.insert(st.head.end(), data, data + len);
+    } else if (st.offset < st.payload_begin) {
+      len = std::min(n, st.payload_begin - st.offset);
+    } else if (st.offset < st.payload_begin + st.payload_len) {
+      len = std::min(n, st.payload_begin + st.payload_len - st.offset);
+      st.consume(data, len);
+    } else if (st.offset < st.tokens_field.offset) {
+      len = std::min(n, st.tokens_field.offset - st.offset);
+    } else if (st.offset < st.tokens_field.offset + st.tokens_field.length) {
+      len = std::min(n, st.tokens_field.offset + st.tokens_field.length - st.offset);
+      st.token_bytes.insert(st.token_bytes.end(), data, data + len);
+    } else {
+      len = n;
+    }
+    // The checksum covers everything after the header.
+    if (st.offset + len > sizeof(header)) {
+      auto skip = st.offset < sizeof(header) ? sizeof(header) - st.offset : 0;
+      st.h.update(data + skip, len - skip);
+    }
+    data += len;
+    n -= len;
+    st.offset += len;
+    if (!st.ready && st.head.size() == st.head_size()) {
+      st.parse_head();
+    }
+  }
+}
+
+token_history loader::finish() {
+  auto& st = *state_;
+  if (!st.ready || st.offset < st.payload_begin + st.payload_len || st.offset < st.tokens_field.offset + st.tokens_field.length) {
+    throw std::invalid_argument("Invalid dump format: length too short");
+  }
+#ifdef CGEMMA_WITH_ZLIB
+  if (st.z) {
+    st.z->finish();
+  }
+#endif
+  // Rows are already overwritten at this point, the state is left at the
+  // first loaded row.
+  if (st.head.size() >= sizeof(header) && (st.hdr.flags & has_checksum) && st.h.digest() != st.hdr.checksum) {
+    throw std::invalid_argument("Invalid dump format: checksum mismatch");
+  }
+  auto history = read_tokens(st.sess, st.tokens_field, st.token_bytes.data());
+  st.sess->set_pos(st.hdr.pos);
+  return history;
+}
+
+token_history load(session* sess, const char* buf, size_t n, std::shared_ptr<const utils::file_reader> src) {
+  if (n < sizeof(magic) || std::memcmp(buf, magic, sizeof(magic) - 1) != 0) {
+    throw std::invalid_argument("Invalid dump format: magic mismatch");
+  }
+  if (static_cast<uint8_t>(buf[sizeof(magic) - 1]) == v2_marker) {
+    return load_v2(sess, buf, n, std::move(src));
+  }
+  load_v1(sess, buf, n, std::move(src));
+  return {};
+}
+
+} }
@@ -0,0 +1,94 @@
+#ifndef CGEMMA_SNAPSHOT_HPP
+#define CGEMMA_SNAPSHOT_HPP
+
+#include "utils/file_io.hpp"
+#include <vector>
+#include <memory>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+
+namespace cgemma {
+
+class session;
+
+}
+
+namespace cgemma { namespace snapshot {
+
+enum class encoding: uint32_t {
+  raw,
+  bf16,
+  int8,
+  deflate
+};
+
+struct options {
+  bool checksum {false};
+  encoding kv_encoding {encoding::raw};
+  // Only the KV cache rows from this position on are stored, which makes a
+  // delta that applies to the state it was dumped from.
+  size_t since {0};
+};
+
+using sink = std::function<void(const char*, size_t)>;
+
+// Tokens stored along with the KV cache rows, from `first_pos` up to the
+// position of the state, so that a speculator can pick up where it was.
+struct token_history {
+  bool present {false};
+  size_t first_pos {0};
+  std::vector<int> tokens;
+};
+
+// Serializes the state of a session. The size of the state data is known
+// once constructed, so it can be written into a preallocated buffer. The
+// tokens of the session are stored as well if its speculator knows them.
+class dumper {
+public:
+  dumper(const session* sess, const options& opts);
+
+  size_t size() const { return size_; }
+
+  void write(char* buf) const;
+  // Writes the state data to `fn` in slices of `chunk_size` bytes (the last
+  // one may be shorter), raw rows are passed straight from the KV cache.
+  void write(size_t chunk_size, const sink& fn) const;
+
+private:
+  const session* sess_;
+  options opts_;
+  size_t payload_offset_;
+  size_t size_;
+  // Only variable-length encodings are buffered.
+  std::vector<char> payload_;
+  bool has_tokens_ {false};
+  std::vector<int32_t> tokens_;
+};
+// Restores the state of `sess` from `buf`, a delta is applied on top of the
+// current state. When `src` is given, `buf` must
+// point into its mapping and restoring the KV cache rows may be deferred.
+// Returns the tokens stored along with the state, if any.
+token_history load(session* sess, const char* buf, size_t n, std::shared_ptr<const utils::file_reader> src = nullptr);
+
+// Restores the state of a session from state data fed in slices of any size,
+// rows are written to the KV cache as they arrive.
+class loader {
+public:
+  explicit loader(session* sess);
+  ~loader();
+
+  void update(const char* data, size_t n);
+  // Checks that the state data is complete and commits the position,
+  // returns the tokens stored along with the state, if any.
+  token_history finish();
+
+private:
+  struct state;
+
+  std::unique_ptr<state> state_;
+};
+
+} }
+
+#endif  // CGEMMA_SNAPSHOT_HPP
@@ -0,0 +1,272 @@
+#include "speculative.hpp"
+#include "instance.hpp"
+#include "session.hpp"
+#include "sampler.hpp"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+gcpp::RuntimeConfig runtime_config(cgemma::session* sess) {
+  gcpp::RuntimeConfig cfg;
+  sess->args().CopyTo(cfg);
+  cfg.verbosity = 0;
+  cfg.gen = &sess->rng();
+  if (!sess->filter().empty()) {
+    cfg.sample_func = [sess](size_t, size_t, gcpp::Logits logits, size_t) {
+      return cgemma::sample(logits, sess->args().temperature, sess->args().top_k, sess->filter(), sess->rng());
+    };
+  }
+  return cfg;
+}
+
+// Appends to `out` up to `n` tokens that followed the latest earlier
+// occurrence of the longest suffix of `tokens` of at most `ngram` tokens.
+void lookup(const std::vector<int>& tokens, size_t end, size_t ngram, size_t n, std::vector<int>& out) {
+  for (auto len = std::min(ngram, end - 1); len > 0; --len) {
+    auto suffix = tokens.begin() + (end - len);
+    for (auto i = end - len; i-- > 0;) {
+      if (std::equal(suffix, suffix + len, tokens.begin() + i)) {
+        auto first = i + len;
+        out.insert(out.end(), tokens.begin() + first, tokens.begin() + std::min(first + n, end));
+        return;
+      }
+    }
+  }
+}
+
+template <class Fn>
+void with_kv_cache(cgemma::session* sess, Fn&& fn) {
+  auto& kv_cache = sess->mutable_kv_cache();
+  if (sess->inst()->kv_offload()) {
+    sess->inst()->kv_offload()->trim(1);
+  }
+  cgemma::scheduler::generation_lock lock(sess->inst()->sched());
+  fn(kv_cache);
+}
+
+}
+
+namespace cgemma {
+
+speculator::speculator(instance* draft, int argc, char* argv[], bool no_wrapping, size_t draft_tokens)
+  : draft_(std::make_unique<session>(draft, argc, argv, no_wrapping, false, 0))
+  , draft_tokens_(draft_tokens) {
+  // nop
+}
+
+speculator::speculator(size_t ngram, size_t draft_tokens)
+  : ngram_(ngram)
+  , draft_tokens_(draft_tokens) {
+  // nop
+}
+
+speculator::speculator(const speculator& other)
+  : ngram_(other.ngram_)
+  , draft_tokens_(other.draft_tokens_)
+  , history_(other.history_)
+  , synced_(other.synced_) {
+  if (other.draft_) {
+    other.draft_->fault_in();
+    draft_ = std::make_unique<session>(other.draft_.get());
+  }
+}
+
+speculator::~speculator() = default;
+
+bool speculator::generate(session* sess, const std::vector<int>& prompt, const gcpp::BatchStreamFunc& stream_token) {
+  if (sess->pos() == 0) {
+    reset();
+  } else if (!synced_ || history_.size() != sess->pos()) {
+    invalidate();
+    return false;
+  }
+  try {
+    auto inst = sess->inst();
+    auto start_pos = sess->pos();
+    // Known tokens, indexed by position.
+    auto tokens = std::move(history_);
+    history_.clear();
+    tokens.insert(tokens.end(), prompt.begin(), prompt.end());
+    auto record = [&](size_t pos, int token) {
+      if (pos >= tokens.size()) {
+        tokens.resize(pos + 1);
+      }
+      tokens[pos] = token;
+    };
+
+    // The target prefills the prompt and samples the first token, the last
+    // token sampled is never in the KV cache of the target.
+    auto max_generated = sess->args().max_generated_tokens;
+    auto cfg = runtime_config(sess);
+    cfg.max_generated_tokens = 1;
+    auto running = true;
+    size_t generated = 0;
+    size_t last_pos = 0;
+    cfg.batch_stream_token = [&](size_t, size_t pos, int token, float prob) {
+      if (pos - start_pos < prompt.size()) {
+        running = stream_token(0, pos, token, prob);
+        return running;
+      }
+      record(pos, token);
+      last_pos = pos;
+      ++generated;
+      running = stream_token(0, pos, token, prob);
+      return false;
+    };
+    with_kv_cache(sess, [&](gcpp::KVCache& kv_cache) {
+      auto cached = sess->restore_prefix(prompt);
+      inst->model().Generate(cfg, gcpp::PromptTokens(prompt.data() + cached, prompt.size() - cached), sess->pos(), kv_cache, inst->matmul_env(), sess->timing_info());
+    });
+    if (start_pos == 0) {
+      sess->cache_prefix(prompt);
+    }
+
+    auto decode_start = std::chrono::steady_clock::now();
+    gcpp::RuntimeConfig dcfg;
+    if (draft_) {
+      dcfg = runtime_config(draft_.get());
+    }
+    std::vector<int> inputs;
+    std::vector<int> verified;
+    while (running && generated > 0 && generated < max_generated) {
+      auto room = draft_ ? std::min(sess->capacity(), draft_->capacity()) : sess->capacity();
+      if (last_pos >= room) {
+        break;
+      }
+      auto n = std::min({draft_tokens_, max_generated - generated - 1, room - last_pos - 1});
+      inputs.assign(1, tokens[last_pos]);
+      if (n > 0 && !draft_) {
+        lookup(tokens, last_pos + 1, ngram_, n, inputs);
+      } else if (n > 0) {
+        // The draft catches up from its position and proposes `n` tokens,
+        // the last proposal is never in its KV cache.
+        auto draft_pos = draft_->pos();
+        dcfg.max_generated_tokens = n;
+        dcfg.batch_stream_token = [&](size_t, size_t pos, int token, float) {
+          if (pos <= last_pos) {
+            return true;
+          }
+          inputs.push_back(token);
+          return inputs.size() <= n && !inst->eos(token);
+        };
+        with_kv_cache(draft_.get(), [&](gcpp::KVCache& kv_cache) {
+          draft_->inst()->model().Generate(dcfg, gcpp::PromptTokens(tokens.data() + draft_pos, last_pos - draft_pos + 1), draft_pos, kv_cache, draft_->inst()->matmul_env(), draft_->timing_info());
+        });
+        draft_->set_pos(inputs.size() > 1 ? last_pos + inputs.size() - 1 : draft_pos);
+      }
+
+      // Every input is a query of its own at consecutive positions in the
+      // same KV cache. The KV rows of a decode step are written before any
+      // query attends to them, so each query sees the inputs before it.
+      auto m = inputs.size() - 1;
+      verified.assign(inputs.size(), -1);
+      cfg.batch_stream_token = [&](size_t query_idx, size_t pos, int token, float) {
+        if (pos <= last_pos + query_idx) {
+          return true;
+        }
+        verified[query_idx] = token;
+        return false;
+      };
+      with_kv_cache(sess, [&](gcpp::KVCache& kv_cache) {
+        gcpp::AllQueries queries;
+        queries.Reserve(inputs.size());
+        for (size_t i = 0; i < inputs.size(); ++i) {
+          queries.Append(gcpp::PerQuery{
+            .prompt = gcpp::PromptTokens(inputs.data() + i, 1),
+            .mutable_pos = last_pos + i,
+            .initial_pos = last_pos + i,
+            .prefix_end = 0,
+            .kv_cache = kv_cache
+          });
+        }
+        gcpp::TimingInfo timing;
+        inst->model().GenerateBatch(cfg, queries, inst->matmul_env(), timing);
+      });
+
+      // Proposals are accepted as long as the target sampled the same, the
+      // token sampled after the last accepted one comes for free.
+      size_t accepted = 0;
+      while (accepted < m && verified[accepted] == inputs[accepted + 1] && !inst->eos(inputs[accepted + 1])) {
+        ++accepted;
+      }
+      proposed_ += m;
+      accepted_ += accepted;
+      if (draft_ && m > 0) {
+        draft_->set_pos(std::min(draft_->pos(), last_pos + accepted + 1));
+      }
+      for (size_t i = 0; i <= accepted && running && generated < max_generated; ++i) {
+        if (verified[i] < 0) {
+          running = false;
+          break;
+        }
+        record(last_pos + 1 + i, verified[i]);
+        ++generated;
+        running = stream_token(0, last_pos + 1 + i, verified[i], 0.0f);
+      }
+      last_pos += accepted + 1;
+    }
+    auto& timing = sess->timing_info();
+    timing.generate_duration += std::chrono::duration<double>(std::chrono::steady_clock::now() - decode_start).count();
+    timing.tokens_generated = generated;
+
+    auto end = sess->pos();
+    if (end > tokens.size()) {
+      invalidate();
+      return true;
+    }
+    if (draft_ && draft_->pos() > end) {
+      draft_->set_pos(end);
+    }
+    tokens.resize(end);
+    history_ = std::move(tokens);
+    return true;
+  } catch (...) {
+    invalidate();
+    throw;
+  }
+}
+
+void speculator::append(const session* sess, size_t start_pos, const std::vector<int>& tokens) {
+  if (start_pos == 0) {
+    reset();
+  }
+  auto end = sess->pos();
+  if (!synced_ || history_.size() < start_pos || end < start_pos || end - start_pos > tokens.size()) {
+    invalidate();
+    return;
+  }
+  history_.resize(start_pos);
+  history_.insert(history_.end(), tokens.begin(), tokens.begin() + (end - start_pos));
+  if (draft_ && draft_->pos() > start_pos) {
+    draft_->set_pos(start_pos);
+  }
+}
+
+void speculator::append(const session* sess, size_t start_pos, const std::vector<int>& prompt, const std::vector<int>& reply) {
+  auto tokens = prompt;
+  tokens.insert(tokens.end(), reply.begin(), reply.end());
+  append(sess, start_pos, tokens);
+}
+
+size_t speculator::known_pos() const {
+  return draft_ ? draft_->pos() : 0;
+}
+
+void speculator::reset() {
+  if (draft_) {
+    draft_->reset();
+  }
+  history_.clear();
+  synced_ = true;
+}
+
+void speculator::invalidate() {
+  if (draft_) {
+    draft_->reset();
+  }
+  history_.clear();
+  synced_ = false;
+}
+
+}
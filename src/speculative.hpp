@@ -0,0 +1,63 @@
+#ifndef CGEMMA_SPECULATIVE_HPP
+#define CGEMMA_SPECULATIVE_HPP
+
+#include <gemma/gemma.h>
+#include <memory>
+#include <vector>
+
+namespace cgemma {
+
+class instance;
+class session;
+
+// Speculative decoding, up to `draft_tokens` tokens are proposed at once and
+// the target verifies them in a single batched forward pass. Proposals come
+// from a draft model sharing the tokenizer of the target, or from the tokens
+// that followed an earlier occurrence of the latest n-gram in the session.
+class speculator {
+public:
+  speculator(instance* draft, int argc, char* argv[], bool no_wrapping, size_t draft_tokens);
+  speculator(size_t ngram, size_t draft_tokens);
+  // Forks the draft session of `other`, if any.
+  speculator(const speculator& other);
+  ~speculator();
+
+  size_t draft_tokens() const { return draft_tokens_; }
+  size_t proposed() const { return proposed_; }
+  size_t accepted() const { return accepted_; }
+  // Null if the draft is out of sync, otherwise the tokens of the session up
+  // to its position.
+  const std::vector<int>* history() const { return synced_ ? &history_ : nullptr; }
+
+  // Generates a reply to `prompt` in `sess`, returns false without doing
+  // anything if the draft is out of sync with the session.
+  bool generate(session* sess, const std::vector<int>& prompt, const gcpp::BatchStreamFunc& stream_token);
+  // Records `tokens` fed to the session from `start_pos` on, up to its
+  // current position, so the draft catches up lazily. Tokens recorded from
+  // `start_pos` on before are replaced.
+  void append(const session* sess, size_t start_pos, const std::vector<int>& tokens);
+  // Same as above, the tokens being `prompt` followed by `reply`.
+  void append(const session* sess, size_t start_pos, const std::vector<int>& prompt, const std::vector<int>& reply);
+  void reset();
+  // Called when the session changes in a way the draft cannot follow, the
+  // draft stays out of sync until the session is reset.
+  void invalidate();
+
+private:
+  // Position up to which the draft has the tokens in its KV cache.
+  size_t known_pos() const;
+
+  std::unique_ptr<session> draft_;
+  size_t ngram_ {0};
+  size_t draft_tokens_;
+  // Tokens of the session, those from `known_pos()` on are not fed to the
+  // draft yet. Without a draft model they are used for the n-gram lookup.
+  std::vector<int> history_;
+  bool synced_ {true};
+  size_t proposed_ {0};
+  size_t accepted_ {0};
+};
+
+}
+
+#endif  // CGEMMA_SPECULATIVE_HPP
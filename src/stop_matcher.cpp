@@ -0,0 +1,52 @@
+#include "stop_matcher.hpp"
+#include "instance.hpp"
+#include <algorithm>
+
+namespace cgemma {
+
+stop_matcher::stop_matcher(const instance* inst, const stop_options& opts)
+  : opts_(&opts)
+  , detok_(&inst->pieces()) {
+  for (const auto& s: opts.strings) {
+    max_string_ = std::max(max_string_, s.size());
+  }
+  for (const auto& seq: opts.sequences) {
+    max_sequence_ = std::max(max_sequence_, seq.size());
+  }
+}
+
+bool stop_matcher::push(int token) {
+  auto matched = false;
+  if (max_sequence_ > 0) {
+    if (tokens_.size() == max_sequence_) {
+      tokens_.erase(tokens_.begin());
+    }
+    tokens_.push_back(token);
+    for (const auto& seq: opts_->sequences) {
+      if (!seq.empty() && seq.size() <= tokens_.size() && std::equal(seq.rbegin(), seq.rend(), tokens_.rbegin())) {
+        matched = true;
+        break;
+      }
+    }
+  }
+  if (max_string_ > 0) {
+    auto old_size = text_.size();
+    detok_.append(token, text_);
+    if (text_.size() > old_size) {
+      for (const auto& s: opts_->strings) {
+        // Only matches that end in the text of this token are new.
+        auto from = old_size + 1 > s.size() ? old_size + 1 - s.size() : 0;
+        if (!s.empty() && text_.find(s, from) != std::string::npos) {
+          matched = true;
+          break;
+        }
+      }
+      if (text_.size() >= max_string_) {
+        text_.erase(0, text_.size() - (max_string_ - 1));
+      }
+    }
+  }
+  return matched;
+}
+
+}
@@ -0,0 +1,43 @@
+#ifndef CGEMMA_STOP_MATCHER_HPP
+#define CGEMMA_STOP_MATCHER_HPP
+
+#include "detokenizer.hpp"
+#include <string>
+#include <vector>
+
+namespace cgemma {
+
+class instance;
+
+struct stop_options {
+  // Generation stops once the output ends with any of these strings or
+  // token sequences, the match is part of the output.
+  std::vector<std::string> strings;
+  std::vector<std::vector<int>> sequences;
+
+  bool empty() const { return strings.empty() && sequences.empty(); }
+};
+
+class stop_matcher {
+public:
+  // Never matches.
+  stop_matcher() = default;
+  stop_matcher(const instance* inst, const stop_options& opts);
+
+  // Feeds a generated token, returns true if the output ends with a stop
+  // string or sequence.
+  bool push(int token);
+
+private:
+  const stop_options* opts_ {nullptr};
+  detokenizer detok_;
+  // The last bytes and tokens of the output, as many as a match can span.
+  std::string text_;
+  std::vector<int> tokens_;
+  size_t max_string_ {0};
+  size_t max_sequence_ {0};
+};
+
+}
+
+#endif  // CGEMMA_STOP_MATCHER_HPP
@@ -0,0 +1,33 @@
+#include "stream_buffer.hpp"
+#include "instance.hpp"
+
+namespace cgemma {
+
+stream_buffer::stream_buffer(const instance* inst, const stream_options& opts)
+  : opts_(opts)
+  , detok_(&inst->pieces())
+  , last_flush_(std::chrono::steady_clock::now()) {
+  // nop
+}
+
+bool stream_buffer::push(int token) {
+  detok_.append(token, text_);
+  if (++tokens_ >= opts_.chunk_tokens) {
+    return true;
+  }
+  return opts_.interval.count() > 0 && std::chrono::steady_clock::now() - last_flush_ >= opts_.interval;
+}
+
+void stream_buffer::finish() {
+  detok_.finish(text_);
+}
+
+void stream_buffer::flush() {
+  text_.clear();
+  tokens_ = 0;
+  if (opts_.interval.count() > 0) {
+    last_flush_ = std::chrono::steady_clock::now();
+  }
+}
+
+}
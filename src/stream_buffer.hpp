@@ -0,0 +1,49 @@
+#ifndef CGEMMA_STREAM_BUFFER_HPP
+#define CGEMMA_STREAM_BUFFER_HPP
+
+#include "detokenizer.hpp"
+#include <string>
+#include <chrono>
+
+namespace cgemma {
+
+class instance;
+
+struct stream_options {
+  // Generated tokens are passed to the stream function in chunks of up to
+  // `chunk_tokens` tokens, a chunk is flushed early once `interval` passed
+  // since the last one.
+  size_t chunk_tokens {1};
+  std::chrono::microseconds interval {0};
+  // Whether the stream function is called for prompt tokens.
+  bool prefill {true};
+};
+
+class stream_buffer {
+public:
+  stream_buffer() = default;
+  stream_buffer(const instance* inst, const stream_options& opts);
+
+  bool prefill() const { return opts_.prefill; }
+  // The text of the tokens buffered since the last flush, a partial UTF-8
+  // sequence at the end is held back.
+  const std::string& text() const { return text_; }
+
+  // Buffers a token, returns true if the buffered tokens are due to be
+  // flushed.
+  bool push(int token);
+  // Buffers the partial UTF-8 sequence held back, if any.
+  void finish();
+  void flush();
+
+private:
+  stream_options opts_;
+  detokenizer detok_;
+  std::string text_;
+  size_t tokens_ {0};
+  std::chrono::steady_clock::time_point last_flush_;
+};
+
+}
+
+#endif  // CGEMMA_STREAM_BUFFER_HPP
@@ -0,0 +1,325 @@
+#include "task.hpp"
+#include "instance.hpp"
+#include "session.hpp"
+#include "image_tokens.hpp"
+#include "grammar.hpp"
+#include "sampler.hpp"
+#include "speculative.hpp"
+#include <stdexcept>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+namespace {
+
+constexpr const char name[] = "cgemma.task";
+
+int push_poll_result(lua_State* L, cgemma::task* t) {
+  try {
+    std::string text;
+    std::vector<int> tokens;
+    auto done = t->poll(text, tokens);
+    if (t->output_tokens()) {
+      lua_createtable(L, tokens.size(), 0);
+      for (size_t i = 0; i < tokens.size(); ++i) {
+        lua_pushinteger(L, tokens[i]);
+        lua_rawseti(L, -2, i + 1);
+      }
+    } else {
+      lua_pushlstring(L, text.data(), text.size());
+    }
+    lua_pushboolean(L, done ? 1 : 0);
+    return 2;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+int fd(lua_State* L) {
+  lua_pushinteger(L, cgemma::task::check(L, 1)->fd());
+  return 1;
+}
+
+int poll(lua_State* L) {
+  return push_poll_result(L, cgemma::task::check(L, 1));
+}
+
+int wait(lua_State* L) {
+  auto t = cgemma::task::check(L, 1);
+  t->wait();
+  return push_poll_result(L, t);
+}
+
+int cancel(lua_State* L) {
+  cgemma::task::check(L, 1)->cancel();
+  return 0;
+}
+
+int destroy(lua_State* L) {
+  auto t = cgemma::task::check(L, 1);
+  t->release(L);
+  t->~task();
+  return 0;
+}
+
+}
+
+namespace cgemma {
+
+task::task(session* sess, const gcpp::ImageTokens* image, std::vector<int>&& prompt)
+  : sess_(sess)
+  , image_(image)
+  , prompt_(std::move(prompt))
+  , output_tokens_(sess->output_tokens()) {
+  auto inst = sess_->inst();
+  if (inst->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+    sess_->set_pos(0);
+  } else {
+    sess_->make_room(prompt_.size() + sess_->args().max_generated_tokens);
+  }
+  start_pos_ = sess_->pos();
+  if (!image_) {
+    cached_ = sess_->restore_prefix(prompt_);
+  }
+  // Everything shared with other sessions is done here, the thread only
+  // touches this session and its KV cache.
+  kv_cache_ = sess_->shared_kv_cache();
+  if (inst->kv_offload()) {
+    inst->kv_offload()->trim(1);
+    inst->kv_offload()->forget(sess_);
+  }
+  pos_ = sess_->pos();
+  timing_ = sess_->timing_info();
+  if (pipe2(fds_, O_NONBLOCK | O_CLOEXEC) == -1) {
+    throw std::system_error(errno, std::system_category(), "pipe2");
+  }
+  try {
+    thread_ = std::thread(&task::run, this);
+  } catch (...) {
+    close(fds_[0]);
+    close(fds_[1]);
+    throw;
+  }
+  sess_->set_busy(true);
+}
+
+task::~task() {
+  cancelled_ = true;
+  if (!finished_) {
+    finish();
+  }
+  close(fds_[0]);
+  close(fds_[1]);
+}
+
+bool task::poll(std::string& text, std::vector<int>& tokens) {
+  notified_ = false;
+  char buf[64];
+  while (read(fds_[0], buf, sizeof(buf)) > 0);
+  bool done;
+  std::string error;
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    text = std::move(text_);
+    text_.clear();
+    tokens = std::move(tokens_);
+    tokens_.clear();
+    done = done_;
+    error = error_;
+  }
+  if (done && !finished_) {
+    finish();
+  }
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+  return done;
+}
+
+void task::wait() {
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void task::release(lua_State* L) {
+  luaL_unref(L, LUA_REGISTRYINDEX, sess_ref_);
+  luaL_unref(L, LUA_REGISTRYINDEX, image_ref_);
+}
+
+void task::run() {
+  try {
+    auto inst = sess_->inst();
+    gcpp::RuntimeConfig cfg;
+    sess_->args().CopyTo(cfg);
+    cfg.verbosity = 0;
+    cfg.gen = &sess_->rng();
+    detokenizer detok(&inst->pieces());
+    std::string token_text;
+    stop_matcher stop(inst, sess_->stop_opts());
+    cfg.batch_stream_token = [&](size_t, size_t pos, int token, float) {
+      if (cancelled_) {
+        return false;
+      }
+      if (pos - start_pos_ >= prompt_.size()) {
+        if (inst->eos(token)) {
+          return false;
+        }
+        if (output_tokens_) {
+          {
+            std::lock_guard<std::mutex> lock(mtx_);
+            tokens_.push_back(token);
+          }
+          notify();
+        } else {
+          token_text.clear();
+          detok.append(token, token_text);
+          if (!token_text.empty()) {
+            {
+              std::lock_guard<std::mutex> lock(mtx_);
+              text_ += token_text;
+            }
+            notify();
+          }
+        }
+        output_.push_back(token);
+        pos_ = pos;
+        return !stop.push(token);
+      }
+      pos_ = pos;
+      return true;
+    };
+    auto g = sess_->constraint().get();
+    auto g_state = g ? g->initial() : 0;
+    if (g || !sess_->filter().empty()) {
+      cfg.sample_func = [&](size_t, size_t, gcpp::Logits logits, size_t) {
+        if (g) {
+          g->mask(g_state, logits);
+        }
+        auto tp = sample(logits, sess_->args().temperature, sess_->args().top_k, sess_->filter(), sess_->rng());
+        if (g) {
+          g_state = g->advance(g_state, tp.token);
+        }
+        return tp;
+      };
+    }
+    {
+      scheduler::generation_lock lock(inst->sched());
+      if (image_) {
+        size_t prefix_end = 0;
+        if (inst->model().Config().wrapping == gcpp::PromptWrapping::PALIGEMMA) {
+          cfg.prefill_tbatch_size = prompt_.size();
+          prefix_end = prompt_.size();
+        }
+        cfg.image_tokens = image_;
+        inst->model().Generate(cfg, gcpp::PromptTokens(prompt_.data(), prompt_.size()), pos_, prefix_end, *kv_cache_, inst->matmul_env(), timing_);
+      } else {
+        inst->model().Generate(cfg, gcpp::PromptTokens(prompt_.data() + cached_, prompt_.size() - cached_), pos_, *kv_cache_, inst->matmul_env(), timing_);
+      }
+    }
+    token_text.clear();
+    detok.finish(token_text);
+    std::lock_guard<std::mutex> text_lock(mtx_);
+    text_ += token_text;
+  } catch (const std::exception& e) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    error_ = e.what();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mtx_);
+    done_ = true;
+  }
+  notify();
+}
+
+void task::notify() {
+  if (!notified_.exchange(true)) {
+    char c = 0;
+    while (write(fds_[1], &c, 1) == -1 && errno == EINTR);
+  }
+}
+
+void task::finish() {
+  wait();
+  finished_ = true;
+  // Only the session holds the KV cache from now on, so it is not copied on
+  // the next write.
+  kv_cache_.reset();
+  sess_->set_pos(pos_);
+  sess_->timing_info() = timing_;
+  sess_->set_busy(false);
+  if (auto spec = sess_->spec()) {
+    if (image_) {
+      spec->invalidate();
+    } else {
+      spec->append(sess_, start_pos_, prompt_, output_);
+    }
+  }
+  if (!image_ && start_pos_ == 0) {
+    sess_->cache_prefix(prompt_);
+  }
+}
+
+void task::declare(lua_State* L) {
+  constexpr const luaL_Reg metatable[] = {
+    {"__gc", destroy},
+    {nullptr, nullptr}
+  };
+  constexpr const luaL_Reg methods[] = {
+    {"fd", ::fd},
+    {"poll", ::poll},
+    {"wait", ::wait},
+    {"cancel", ::cancel},
+    {nullptr, nullptr}
+  };
+  luaL_newmetatable(L, name);
+  luaL_register(L, nullptr, metatable);
+  lua_pushlstring(L, name, sizeof(name) - 1);
+  lua_setfield(L, -2, "_NAME");
+  lua_newtable(L);
+  luaL_register(L, nullptr, methods);
+  lua_setfield(L, -2, "__index");
+}
+
+task* task::check(lua_State* L, int index) {
+  return static_cast<task*>(luaL_checkudata(L, index, name));
+}
+
+int task::create(lua_State* L) {
+  auto sess = session::check(L, 1);
+  if (sess->busy()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session is busy.");
+    return 2;
+  }
+  if (!sess->context_shift() && sess->pos() >= sess->inst()->max_tokens()) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "Session has ended.");
+    return 2;
+  }
+  try {
+    auto image = image_tokens::to(L, 2);
+    auto offset = image ? 2 : 1;
+    auto prompt = sess->read_prompt(L, 1 + offset, image);
+    auto ud = lua_newuserdata(L, sizeof(task));
+    auto t = new(ud) task(sess, image, std::move(prompt));
+    luaL_getmetatable(L, name);
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    t->sess_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+    if (image) {
+      lua_pushvalue(L, 2);
+      t->image_ref_ = luaL_ref(L, LUA_REGISTRYINDEX);
+    }
+    return 1;
+  } catch (const std::exception& e) {
+    lua_pushnil(L);
+    lua_pushstring(L, e.what());
+    return 2;
+  }
+}
+
+}
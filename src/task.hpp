@@ -0,0 +1,75 @@
+#ifndef CGEMMA_TASK_HPP
+#define CGEMMA_TASK_HPP
+
+#include <lua.hpp>
+#include <gemma/gemma.h>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace cgemma {
+
+class session;
+
+// Generates a reply of a session on a thread of its own, the text produced
+// is drained by polling. The read end of a pipe becomes readable whenever
+// there is something to drain, so that event loops can wait on it.
+class task {
+public:
+  task(session* sess, const gcpp::ImageTokens* image, std::vector<int>&& prompt);
+  ~task();
+
+  int fd() const { return fds_[0]; }
+  bool output_tokens() const { return output_tokens_; }
+
+  // Moves the text produced so far to `text`, or the token IDs to `tokens`
+  // if the session outputs tokens, returns true once the generation is
+  // finished.
+  bool poll(std::string& text, std::vector<int>& tokens);
+  void wait();
+  void cancel() { cancelled_ = true; }
+  // Releases the references to the session and the image.
+  void release(lua_State* L);
+
+  static void declare(lua_State* L);
+  static task* check(lua_State* L, int index);
+  static int create(lua_State* L);
+
+private:
+  void run();
+  void notify();
+  void finish();
+
+  session* sess_;
+  const gcpp::ImageTokens* image_;
+  std::vector<int> prompt_;
+  size_t start_pos_;
+  size_t cached_ {0};
+  bool output_tokens_;
+  // Owned by the task as well, so it stays alive until the thread is joined.
+  std::shared_ptr<gcpp::KVCache> kv_cache_;
+  // Written by the thread only, and copied to the session when the task is
+  // finished.
+  size_t pos_;
+  std::vector<int> output_;
+  gcpp::TimingInfo timing_;
+  int sess_ref_ {LUA_NOREF};
+  int image_ref_ {LUA_NOREF};
+  int fds_[2] {-1, -1};
+  std::mutex mtx_;
+  std::string text_;
+  std::vector<int> tokens_;
+  std::string error_;
+  bool done_ {false};
+  bool finished_ {false};
+  std::atomic<bool> cancelled_ {false};
+  std::atomic<bool> notified_ {false};
+  std::thread thread_;
+};
+
+}
+
+#endif  // CGEMMA_TASK_HPP
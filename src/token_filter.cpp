@@ -0,0 +1,114 @@
+#include "token_filter.hpp"
+#include "instance.hpp"
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <cmath>
+
+namespace cgemma {
+
+token_filter::token_filter(size_t vocab_size)
+  : bits_((vocab_size + 63) / 64)
+  , offsets_(vocab_size) {
+  // nop
+}
+
+std::vector<int> token_filter::disabled_tokens() const {
+  std::vector<int> tokens;
+  tokens.reserve(disabled_);
+  for (size_t i = 0; i < offsets_.size() && tokens.size() < disabled_; ++i) {
+    if (!enabled(i)) {
+      tokens.push_back(i);
+    }
+  }
+  return tokens;
+}
+
+void token_filter::disable(int token) {
+  if (token < 0 || static_cast<size_t>(token) >= offsets_.size() || !enabled(token)) {
+    return;
+  }
+  bits_[token / 64] |= uint64_t(1) << (token % 64);
+  offsets_[token] = -std::numeric_limits<float>::infinity();
+  ++disabled_;
+}
+
+void token_filter::bias(int token, float value) {
+  if (token < 0 || static_cast<size_t>(token) >= offsets_.size() || !enabled(token)) {
+    return;
+  }
+  offsets_[token] += value;
+  biased_ = true;
+}
+
+void token_filter::merge(const token_filter& other) {
+  if (offsets_.size() < other.offsets_.size()) {
+    bits_.resize(other.bits_.size());
+    offsets_.resize(other.offsets_.size());
+  }
+  for (size_t i = 0; i < other.offsets_.size(); ++i) {
+    if (!other.enabled(i)) {
+      disable(i);
+    } else if (other.offsets_[i] != 0.0f) {
+      bias(i, other.offsets_[i]);
+    }
+  }
+}
+
+void token_filter::apply(gcpp::Logits logits) const {
+  if (empty()) {
+    return;
+  }
+  // A plain loop over contiguous floats, which compilers vectorize.
+  auto n = std::min(logits.size(), offsets_.size());
+  auto data = logits.data();
+  auto offsets = offsets_.data();
+  for (size_t i = 0; i < n; ++i) {
+    data[i] += offsets[i];
+  }
+}
+
+bool read_filter_options(lua_State* L, int index, const instance* inst, token_filter& filter) {
+  auto found = false;
+  lua_getfield(L, index, "disabled_words");
+  if (lua_istable(L, -1)) {
+    found = true;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      auto word = lua_tostring(L, -1);
+      if (word) {
+        std::vector<int> tokens;
+        if (!inst->model().Tokenizer().Encode(word, &tokens)) {
+          throw std::runtime_error("Tokenizer encoding failed. (read_filter_options)");
+        }
+        for (auto t: tokens) {
+          filter.disable(t);
+        }
+      }
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, index, "logit_bias");
+  if (lua_istable(L, -1)) {
+    found = true;
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+      if (lua_type(L, -2) != LUA_TNUMBER || !lua_isnumber(L, -1)) {
+        throw std::invalid_argument("logit_bias must map tokens to numbers");
+      }
+      auto token = lua_tointeger(L, -2);
+      auto value = static_cast<float>(lua_tonumber(L, -1));
+      if (token < 0 || static_cast<size_t>(token) >= inst->pieces().size() || !std::isfinite(value)) {
+        throw std::invalid_argument("logit_bias must map tokens to numbers");
+      }
+      filter.bias(token, value);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  return found;
+}
+
+}
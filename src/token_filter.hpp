@@ -0,0 +1,50 @@
+#ifndef CGEMMA_TOKEN_FILTER_HPP
+#define CGEMMA_TOKEN_FILTER_HPP
+
+#include <lua.hpp>
+#include <gemma/gemma.h>
+#include <gemma/gemma_args.h>
+#include <vector>
+#include <cstdint>
+
+namespace cgemma {
+
+class instance;
+
+// Disabled tokens and logit biases over the vocabulary, kept dense so that
+// applying them to the logits is a single pass without lookups.
+class token_filter {
+public:
+  token_filter() = default;
+  explicit token_filter(size_t vocab_size);
+
+  bool empty() const { return disabled_ == 0 && !biased_; }
+  bool enabled(int token) const {
+    return disabled_ == 0 || token < 0 || static_cast<size_t>(token) >= offsets_.size() || !((bits_[token / 64] >> (token % 64)) & 1);
+  }
+  std::vector<int> disabled_tokens() const;
+
+  void disable(int token);
+  // Biases of the same token add up.
+  void bias(int token, float value);
+  // Disables the tokens disabled in `other` and adds its biases.
+  void merge(const token_filter& other);
+  // Adds the biases to `logits` and sets the logits of disabled tokens to
+  // -inf.
+  void apply(gcpp::Logits logits) const;
+
+private:
+  std::vector<uint64_t> bits_;
+  // The bias of each token, -inf if it is disabled.
+  std::vector<float> offsets_;
+  size_t disabled_ {0};
+  bool biased_ {false};
+};
+
+// Reads the `disabled_words` and `logit_bias` options from the table at
+// `index` into `filter`, returns true if any is given.
+bool read_filter_options(lua_State* L, int index, const instance* inst, token_filter& filter);
+
+}
+
+#endif  // CGEMMA_TOKEN_FILTER_HPP
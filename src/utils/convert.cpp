@@ -0,0 +1,112 @@
+#undef HWY_TARGET_INCLUDE
+#define HWY_TARGET_INCLUDE "utils/convert.cpp"
+#include <hwy/foreach_target.h>
+#include <hwy/highway.h>
+#include "convert.hpp"
+#include <algorithm>
+#include <cmath>
+
+HWY_BEFORE_NAMESPACE();
+namespace cgemma { namespace utils { namespace HWY_NAMESPACE {
+
+namespace hn = hwy::HWY_NAMESPACE;
+
+void F32ToBF16(const float* HWY_RESTRICT in, size_t n, hwy::bfloat16_t* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<hwy::bfloat16_t, decltype(df)> dbf;
+  const size_t N = hn::Lanes(df);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    hn::StoreU(hn::DemoteTo(dbf, hn::LoadU(df, in + i)), dbf, out + i);
+  }
+  for (; i < n; ++i) {
+    out[i] = hwy::BF16FromF32(in[i]);
+  }
+}
+
+void BF16ToF32(const hwy::bfloat16_t* HWY_RESTRICT in, size_t n, float* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<hwy::bfloat16_t, decltype(df)> dbf;
+  const size_t N = hn::Lanes(df);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    hn::StoreU(hn::PromoteTo(df, hn::LoadU(dbf, in + i)), df, out + i);
+  }
+  for (; i < n; ++i) {
+    out[i] = hwy::F32FromBF16(in[i]);
+  }
+}
+
+float F32ToI8(const float* HWY_RESTRICT in, size_t n, int8_t* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<int8_t, decltype(df)> di8;
+  const size_t N = hn::Lanes(df);
+  auto vmax = hn::Zero(df);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    vmax = hn::Max(vmax, hn::Abs(hn::LoadU(df, in + i)));
+  }
+  auto max_abs = hn::ReduceMax(df, vmax);
+  for (; i < n; ++i) {
+    max_abs = std::max(max_abs, std::abs(in[i]));
+  }
+  const auto scale = max_abs / 127.0f;
+  const auto inv_scale = scale > 0.0f ? 1.0f / scale : 0.0f;
+  const auto vinv_scale = hn::Set(df, inv_scale);
+  for (i = 0; i + N <= n; i += N) {
+    auto q = hn::NearestInt(hn::Mul(hn::LoadU(df, in + i), vinv_scale));
+    hn::StoreU(hn::DemoteTo(di8, q), di8, out + i);
+  }
+  for (; i < n; ++i) {
+    out[i] = static_cast<int8_t>(std::clamp(std::lrint(in[i] * inv_scale), -127L, 127L));
+  }
+  return scale;
+}
+
+void I8ToF32(const int8_t* HWY_RESTRICT in, size_t n, float scale, float* HWY_RESTRICT out) {
+  const hn::ScalableTag<float> df;
+  const hn::Rebind<int32_t, decltype(df)> di32;
+  const hn::Rebind<int8_t, decltype(df)> di8;
+  const size_t N = hn::Lanes(df);
+  const auto vscale = hn::Set(df, scale);
+  size_t i = 0;
+  for (; i + N <= n; i += N) {
+    auto v = hn::ConvertTo(df, hn::PromoteTo(di32, hn::LoadU(di8, in + i)));
+    hn::StoreU(hn::Mul(v, vscale), df, out + i);
+  }
+  for (; i < n; ++i) {
+    out[i] = in[i] * scale;
+  }
+}
+
+} } }
+HWY_AFTER_NAMESPACE();
+
+#if HWY_ONCE
+
+namespace cgemma { namespace utils {
+
+HWY_EXPORT(F32ToBF16);
+HWY_EXPORT(BF16ToF32);
+HWY_EXPORT(F32ToI8);
+HWY_EXPORT(I8ToF32);
+
+void f32_to_bf16(const float* in, size_t n, hwy::bfloat16_t* out) {
+  HWY_DYNAMIC_DISPATCH(F32ToBF16)(in, n, out);
+}
+
+void bf16_to_f32(const hwy::bfloat16_t* in, size_t n, float* out) {
+  HWY_DYNAMIC_DISPATCH(BF16ToF32)(in, n, out);
+}
+
+float f32_to_i8(const float* in, size_t n, int8_t* out) {
+  return HWY_DYNAMIC_DISPATCH(F32ToI8)(in, n, out);
+}
+
+void i8_to_f32(const int8_t* in, size_t n, float scale, float* out) {
+  HWY_DYNAMIC_DISPATCH(I8ToF32)(in, n, scale, out);
+}
+
+} }
+
+#endif  // HWY_ONCE
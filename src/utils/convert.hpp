@@ -0,0 +1,18 @@
+#ifndef CGEMMA_UTILS_CONVERT_HPP
+#define CGEMMA_UTILS_CONVERT_HPP
+
+#include <hwy/base.h>
+#include <cstddef>
+#include <cstdint>
+
+namespace cgemma { namespace utils {
+
+void f32_to_bf16(const float* in, size_t n, hwy::bfloat16_t* out);
+void bf16_to_f32(const hwy::bfloat16_t* in, size_t n, float* out);
+// Quantizes `in` symmetrically into `out`, returns the scale.
+float f32_to_i8(const float* in, size_t n, int8_t* out);
+void i8_to_f32(const int8_t* in, size_t n, float scale, float* out);
+
+} }
+
+#endif  // CGEMMA_UTILS_CONVERT_HPP
@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <system_error>
 
 namespace cgemma { namespace utils {
 
@@ -16,7 +17,7 @@ fio_base::~fio_base() {
   }
 }
 
-file_reader::file_reader(const std::filesystem::path& path) {
+file_reader::file_reader(const std::filesystem::path& path, bool prefetch) {
   auto fd = open(path.c_str(), O_RDONLY);
   if (fd == -1) {
     throw std::filesystem::filesystem_error("failed to open file", path, std::make_error_code(std::errc(errno)));
@@ -35,7 +36,9 @@ file_reader::file_reader(const std::filesystem::path& path) {
     close(fd);
     throw std::filesystem::filesystem_error("failed to mmap file", path, std::make_error_code(std::errc(errno)));
   }
-  madvise(buf, fs.st_size, MADV_WILLNEED | MADV_SEQUENTIAL);
+  if (prefetch) {
+    madvise(buf, fs.st_size, MADV_WILLNEED | MADV_SEQUENTIAL);
+  }
   init(fd, buf, fs.st_size);
 }
 
@@ -56,4 +59,18 @@ file_writer::file_writer(const std::filesystem::path& path, size_t len) {
   init(fd, buf, len);
 }
 
+void write_fd(int fd, const char* buf, size_t len) {
+  while (len > 0) {
+    auto n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "failed to write file");
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
 } }
@@ -29,6 +29,10 @@ public:
   }
 
 protected:
+  int fd() const {
+    return fd_;
+  }
+
   void init(int fd, void* buf, size_t len) {
     fd_ = fd;
     buf_ = buf;
@@ -43,7 +47,7 @@ private:
 
 class file_reader: public fio_base {
 public:
-  file_reader(const std::filesystem::path& path);
+  file_reader(const std::filesystem::path& path, bool prefetch = true);
 };
 
 class file_writer: public fio_base {
@@ -51,6 +55,9 @@ public:
   file_writer(const std::filesystem::path& path, size_t len);
 };
 
+// Writes all `len` bytes of `buf` to the file descriptor `fd`.
+void write_fd(int fd, const char* buf, size_t len);
+
 } }
 
 #endif  // CGEMMA_UTILS_FILE_IO_HPP
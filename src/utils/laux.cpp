@@ -12,4 +12,14 @@ void* userdata(lua_State* L, int index, const char* name) {
   return r == 0 ? lua_touserdata(L, index) : nullptr;
 }
 
+bool pcall(lua_State* L, int nargs, int nresults, std::string& err) {
+  if (lua_pcall(L, nargs, nresults, 0) == 0) {
+    return true;
+  }
+  auto msg = lua_tostring(L, -1);
+  err = msg ? msg : "Stream function raised an error object";
+  lua_pop(L, 1);
+  return false;
+}
+
 } }
@@ -2,10 +2,14 @@
 #define CGEMMA_UTILS_LAUX_HPP
 
 #include <lua.hpp>
+#include <string>
 
 namespace cgemma { namespace utils {
 
 void* userdata(lua_State* L, int index, const char* name);
+// Same as lua_call, but an error is moved to `err` and false is returned, so
+// that it never unwinds the caller, e.g. while generating.
+bool pcall(lua_State* L, int nargs, int nresults, std::string& err);
 
 } }
 